@@ -33,6 +33,7 @@ int load_flash_data(const char *filename, struct flash_data *target) {
     }
 
     target->num_blocks = 0;
+    memset(target->flash_data, 0xff, sizeof(target->flash_data));
     memset(target->write_blocks, 0, sizeof(target->write_blocks));
     memset(target->erase_blocks, 0, sizeof(target->erase_blocks));
 
@@ -110,7 +111,176 @@ int report_error(libusb_device_handle *handle, const char *cmd) {
     return 1;
 };
 
-int picoboot_flash(libusb_device_handle *handle, struct flash_data *image, model_t model) {
+// Commands are queued asynchronously, so the next command and its data
+// are already waiting on the bus while the device erases or programs
+// the current sector.  The endpoints are shared with picoboot_connection.c.
+extern unsigned int out_ep;
+extern unsigned int in_ep;
+
+#define PIPE_DEPTH 8
+#define PIPE_TIMEOUT 10000
+
+struct pipe_slot {
+    struct picoboot_cmd cmd;
+    uint8_t ack[64];
+    struct libusb_transfer *xfers[3];
+    int pending;
+    int failed;
+};
+
+struct pipeline {
+    libusb_context *ctx;
+    libusb_device_handle *handle;
+    struct pipe_slot slots[PIPE_DEPTH];
+    uint32_t head, tail;
+    uint32_t token;
+    const char *failed_cmd;
+};
+
+void LIBUSB_CALL pipe_transfer_done(struct libusb_transfer *xfer) {
+    struct pipe_slot *slot = xfer->user_data;
+    // The ack is a zero length packet, all other transfers must complete
+    if (xfer->status != LIBUSB_TRANSFER_COMPLETED
+        || (xfer != slot->xfers[2] && xfer->actual_length != xfer->length)) {
+        slot->failed = 1;
+    }
+    slot->pending--;
+}
+
+int pipe_init(struct pipeline *pipe, libusb_context *ctx,
+              libusb_device_handle *handle) {
+    memset(pipe, 0, sizeof(*pipe));
+    pipe->ctx = ctx;
+    pipe->handle = handle;
+    pipe->token = 0x10000;
+    for (int i = 0; i < PIPE_DEPTH; i++) {
+        for (int j = 0; j < 3; j++) {
+            pipe->slots[i].xfers[j] = libusb_alloc_transfer(0);
+            if (!pipe->slots[i].xfers[j]) return 1;
+        }
+    }
+    return 0;
+}
+
+void pipe_free(struct pipeline *pipe) {
+    for (int i = 0; i < PIPE_DEPTH; i++) {
+        for (int j = 0; j < 3; j++) {
+            libusb_free_transfer(pipe->slots[i].xfers[j]);
+        }
+    }
+}
+
+// Wait for the oldest queued command to complete
+int pipe_retire(struct pipeline *pipe) {
+    struct pipe_slot *slot = &pipe->slots[pipe->tail % PIPE_DEPTH];
+    while (slot->pending) {
+        if (libusb_handle_events_completed(pipe->ctx, NULL)) {
+            slot->failed = 1;
+            break;
+        }
+    }
+    if (slot->failed) {
+        pipe->failed_cmd = slot->cmd.bCmdId == PC_FLASH_ERASE
+            ? "flash_erase" : "write";
+        return 1;
+    }
+    pipe->tail++;
+    return 0;
+}
+
+// Cancel all queued commands after a failure
+void pipe_abort(struct pipeline *pipe) {
+    for (uint32_t i = pipe->tail; i != pipe->head; i++) {
+        struct pipe_slot *slot = &pipe->slots[i % PIPE_DEPTH];
+        for (int j = 0; j < 3; j++) {
+            libusb_cancel_transfer(slot->xfers[j]);
+        }
+    }
+    for (uint32_t i = pipe->tail; i != pipe->head; i++) {
+        struct pipe_slot *slot = &pipe->slots[i % PIPE_DEPTH];
+        while (slot->pending) {
+            if (libusb_handle_events_completed(pipe->ctx, NULL)) break;
+        }
+    }
+    pipe->tail = pipe->head;
+}
+
+int pipe_submit_transfer(struct pipeline *pipe, struct pipe_slot *slot,
+                         int idx, unsigned int ep, uint8_t *buf, int len) {
+    struct libusb_transfer *xfer = slot->xfers[idx];
+    libusb_fill_bulk_transfer(xfer, pipe->handle, ep, buf, len,
+                              pipe_transfer_done, slot, PIPE_TIMEOUT);
+    if (libusb_submit_transfer(xfer)) {
+        slot->failed = 1;
+        return 1;
+    }
+    slot->pending++;
+    return 0;
+}
+
+// Queue an erase (data is NULL) or write command
+int pipe_submit(struct pipeline *pipe, uint8_t cmd_id, uint32_t addr,
+                uint8_t *data, uint32_t len) {
+    if (pipe->head - pipe->tail >= PIPE_DEPTH && pipe_retire(pipe)) {
+        return 1;
+    }
+    struct pipe_slot *slot = &pipe->slots[pipe->head++ % PIPE_DEPTH];
+    memset(&slot->cmd, 0, sizeof(slot->cmd));
+    slot->cmd.dMagic = PICOBOOT_MAGIC;
+    slot->cmd.dToken = pipe->token++;
+    slot->cmd.bCmdId = cmd_id;
+    slot->cmd.bCmdSize = sizeof(slot->cmd.range_cmd);
+    slot->cmd.range_cmd.dAddr = addr;
+    slot->cmd.range_cmd.dSize = len;
+    slot->cmd.dTransferLength = data ? len : 0;
+    slot->pending = slot->failed = 0;
+
+    // The ack is read in the opposite direction of the (OUT) data
+    if (pipe_submit_transfer(pipe, slot, 0, out_ep, (uint8_t *)&slot->cmd,
+                             sizeof(slot->cmd))) goto fail;
+    if (data && pipe_submit_transfer(pipe, slot, 1, out_ep, data, len)) {
+        goto fail;
+    }
+    if (pipe_submit_transfer(pipe, slot, 2, in_ep, slot->ack, 1)) goto fail;
+    return 0;
+
+fail:
+    pipe->failed_cmd = cmd_id == PC_FLASH_ERASE ? "flash_erase" : "write";
+    return 1;
+}
+
+// Read back each sector to be erased and drop those that already match
+int compare_flash(libusb_device_handle *handle, struct flash_data *image) {
+    static uint8_t buf[FLASH_SECTOR_ERASE_SIZE];
+    size_t count = 0, skipped = 0;
+
+    fprintf(stderr, "Comparing\n");
+    if (picoboot_enter_cmd_xip(handle)) {
+        return report_error(handle, "enter_cmd_xip");
+    }
+    for (size_t i = 0; i < FLASH_NUM_ERASE_BLOCKS; i++) {
+        if (!image->erase_blocks[i]) continue;
+        uint32_t offset = i * FLASH_SECTOR_ERASE_SIZE;
+        if (picoboot_read(handle, FLASH_START + offset, buf, sizeof(buf))) {
+            return report_error(handle, "read");
+        }
+        count++;
+        // Pages not in the image are expected to be erased
+        if (memcmp(buf, &image->flash_data[offset], sizeof(buf))) continue;
+        image->erase_blocks[i] = 0;
+        size_t first = offset / PAGE_SIZE;
+        for (size_t j = 0; j < FLASH_SECTOR_ERASE_SIZE / PAGE_SIZE; j++) {
+            image->write_blocks[first + j] = 0;
+        }
+        skipped++;
+    }
+    fprintf(stderr, "%zu of %zu sectors already match the image\n",
+            skipped, count);
+    return 0;
+}
+
+int picoboot_flash(libusb_context *ctx, libusb_device_handle *handle,
+                   struct flash_data *image, model_t model, bool compare) {
     fprintf(stderr, "Resetting interface\n");
     if (picoboot_reset(handle)) {
         return report_error(handle, "reset");
@@ -121,28 +291,56 @@ int picoboot_flash(libusb_device_handle *handle, struct flash_data *image, model
         return report_error(handle, "exclusive_access");
     }
 
+    if (compare && compare_flash(handle, image)) {
+        return 1;
+    }
+
     fprintf(stderr, "Exiting XIP mode\n");
     if (picoboot_exit_xip(handle)) {
         return report_error(handle, "exit_xip");
     }
 
-    fprintf(stderr, "Erasing\n");
-    for(size_t i = 0; i < FLASH_NUM_ERASE_BLOCKS; i++) {
+    // Erase each sector and then write its pages, merging runs of
+    // consecutive pages into a single write
+    fprintf(stderr, "Erasing and flashing\n");
+    struct pipeline *pipe = malloc(sizeof(*pipe));
+    if (!pipe || pipe_init(pipe, ctx, handle)) {
+        fprintf(stderr, "Could not allocate USB transfers\n");
+        if (pipe) pipe_free(pipe);
+        free(pipe);
+        return 1;
+    }
+    const size_t pages_per_sector = FLASH_SECTOR_ERASE_SIZE / PAGE_SIZE;
+    int rc = 0;
+    for (size_t i = 0; i < FLASH_NUM_ERASE_BLOCKS && !rc; i++) {
         if (!image->erase_blocks[i]) continue;
         uint32_t addr = FLASH_START + i * FLASH_SECTOR_ERASE_SIZE;
-        if (picoboot_flash_erase(handle, addr, FLASH_SECTOR_ERASE_SIZE)) {
-            return report_error(handle, "flash_erase");
+        rc = pipe_submit(pipe, PC_FLASH_ERASE, addr, NULL,
+                         FLASH_SECTOR_ERASE_SIZE);
+        size_t page = i * pages_per_sector, end = page + pages_per_sector;
+        while (page < end && !rc) {
+            if (!image->write_blocks[page]) {
+                page++;
+                continue;
+            }
+            size_t first = page;
+            while (page < end && image->write_blocks[page]) page++;
+            rc = pipe_submit(pipe, PC_WRITE, FLASH_START + first * PAGE_SIZE,
+                             &image->flash_data[first * PAGE_SIZE],
+                             (page - first) * PAGE_SIZE);
         }
     }
-
-    fprintf(stderr, "Flashing\n");
-    for(size_t i = 0; i < FLASH_NUM_WRITE_BLOCKS; i++) {
-        if (!image->write_blocks[i]) continue;
-        uint32_t addr = FLASH_START + i * PAGE_SIZE;
-        uint8_t *buf = &image->flash_data[i * PAGE_SIZE];
-        if (picoboot_write(handle, addr, buf, PAGE_SIZE)) {
-            return report_error(handle, "write");
-        }
+    while (!rc && pipe->tail != pipe->head) {
+        rc = pipe_retire(pipe);
+    }
+    if (rc) {
+        pipe_abort(pipe);
+        report_error(handle, pipe->failed_cmd);
+    }
+    pipe_free(pipe);
+    free(pipe);
+    if (rc) {
+        return 1;
     }
 
     fprintf(stderr, "Rebooting device\n");
@@ -164,7 +362,8 @@ int picoboot_flash(libusb_device_handle *handle, struct flash_data *image, model
 }
 
 void print_usage(char *argv[]) {
-    fprintf(stderr, "Usage: %s <uf2 image> [bus addr]\n", argv[0]);
+    fprintf(stderr, "Usage: %s [-c] <uf2 image> [bus addr]\n"
+            "  -c  Skip sectors that already match the image\n", argv[0]);
     exit(1);
 }
 
@@ -175,11 +374,17 @@ int main(int argc, char *argv[]) {
     struct flash_data *image = malloc(sizeof(struct flash_data));
     int rc = 0;
 
-    if (argc != 2 && argc != 4) {
+    bool compare = false;
+    int argi = 1;
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        compare = true;
+        argi++;
+    }
+    if (argc - argi != 1 && argc - argi != 3) {
         print_usage(argv);
     }
 
-    if (load_flash_data(argv[1], image)) {
+    if (load_flash_data(argv[argi], image)) {
         fprintf(stderr, "Could not load flash image, exiting\n");
         rc = 1;
         goto do_exit;
@@ -189,15 +394,15 @@ int main(int argc, char *argv[]) {
     bool has_target = false;
     uint8_t target_bus = 0;
     uint8_t target_address = 0;
-    if(argc == 4) {
+    if(argc - argi == 3) {
         has_target = true;
 
         char *endptr;
-        target_bus = strtol(argv[2], &endptr, 10);
-        if (endptr == argv[2] || *endptr != 0) print_usage(argv);
+        target_bus = strtol(argv[argi + 1], &endptr, 10);
+        if (endptr == argv[argi + 1] || *endptr != 0) print_usage(argv);
 
-        target_address = strtol(argv[3], &endptr, 10);
-        if (endptr == argv[3] || *endptr != 0) print_usage(argv);
+        target_address = strtol(argv[argi + 2], &endptr, 10);
+        if (endptr == argv[argi + 2] || *endptr != 0) print_usage(argv);
     }
 
     if (libusb_init(&ctx)) {
@@ -240,7 +445,7 @@ int main(int argc, char *argv[]) {
         libusb_get_bus_number(dev), libusb_get_device_address(dev));
     fprintf(stderr, "Flashing...\n");
 
-    rc = picoboot_flash(handle, image, model);
+    rc = picoboot_flash(ctx, handle, image, model, compare);
 
 do_exit:
     if (handle) {
@@ -0,0 +1,240 @@
+#!/usr/bin/env python3
+# Run Katapult micro-benchmarks under QEMU and check for regressions
+#
+# Copyright (C) 2026  agent <agent@local>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, re, argparse, json, subprocess, tempfile
+
+DEFAULT_CONFIGS = [
+    "test/configs/stm32f4.config",
+    "test/configs/stm32f4-canbus.config",
+]
+
+# QEMU machines able to run a benchmark image.  The machine must have
+# at least as much flash and ram as the configured chip (the only stm32f1
+# machine has 8KiB of ram, which is too small for the stm32f103 configs).
+MACHINES = [
+    ("CONFIG_MACH_STM32F4", "netduinoplus2"),
+    ("CONFIG_MACH_STM32F2", "netduino2"),
+]
+
+DEFAULT_PLUGIN_PATHS = [
+    "/usr/lib/qemu/plugins/libinsn.so",
+    "/usr/local/lib/qemu/plugins/libinsn.so",
+    "/usr/libexec/qemu/plugins/libinsn.so",
+]
+
+class BenchError(Exception):
+    pass
+
+def read_config(path):
+    config = {}
+    with open(path, "r") as f:
+        for line in f:
+            line = line.strip()
+            if line.startswith("CONFIG_") and "=" in line:
+                name, val = line.split("=", 1)
+                config[name] = val
+    return config
+
+def find_machine(config):
+    for option, machine in MACHINES:
+        if config.get(option) == "y":
+            return machine
+    return None
+
+
+######################################################################
+# Image build
+######################################################################
+
+def build_image(cfg_path, out_dir, verbose):
+    os.makedirs(out_dir, exist_ok=True)
+    kconfig = os.path.join(out_dir, ".config")
+    with open(cfg_path, "r") as src, open(kconfig, "w") as dst:
+        dst.write(src.read())
+    make_args = ["make", "OUT=%s/" % (out_dir,), "KCONFIG_CONFIG=" + kconfig]
+    for target in ["olddefconfig", "benchmark"]:
+        res = subprocess.run(
+            make_args + [target], stdout=subprocess.PIPE,
+            stderr=subprocess.STDOUT, universal_newlines=True
+        )
+        if verbose or res.returncode:
+            sys.stdout.write(res.stdout)
+        if res.returncode:
+            raise BenchError("Build of %s failed" % (cfg_path,))
+    return os.path.join(out_dir, "benchmark.elf")
+
+
+######################################################################
+# QEMU execution
+######################################################################
+
+class QemuRunner:
+    def __init__(self, qemu, plugin, machine, image):
+        self.qemu = qemu
+        self.plugin = plugin
+        self.machine = machine
+        self.image = image
+
+    def _run(self, args, log_path=None):
+        cmd = [
+            self.qemu, "-M", self.machine, "-display", "none",
+            "-serial", "none", "-monitor", "none", "-kernel", self.image,
+            "-semihosting-config",
+            "enable=on,target=native,arg=benchmark," +
+            ",".join(["arg=%s" % (a,) for a in args])
+        ]
+        if log_path is not None:
+            cmd += ["-plugin", self.plugin, "-d", "plugin", "-D", log_path]
+        try:
+            res = subprocess.run(
+                cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                universal_newlines=True, timeout=120.
+            )
+        except subprocess.TimeoutExpired:
+            raise BenchError("QEMU timed out running %s" % (" ".join(args),))
+        if res.returncode:
+            raise BenchError(
+                "QEMU failed running %s:\n%s" % (" ".join(args), res.stdout)
+            )
+        return res.stdout
+
+    def list_benchmarks(self):
+        return self._run(["list"]).split()
+
+    def count_instructions(self, name, iterations):
+        with tempfile.NamedTemporaryFile(suffix=".log") as log:
+            self._run([name, str(iterations)], log.name)
+            data = log.read().decode()
+        # The last count reported is the total over all cpus
+        counts = re.findall(r"insns:\s*(\d+)", data)
+        if not counts:
+            raise BenchError("No instruction count reported by plugin")
+        return int(counts[-1])
+
+    def measure(self, name, iterations):
+        # Run twice so that startup and exit costs cancel out
+        first = self.count_instructions(name, iterations)
+        second = self.count_instructions(name, 2 * iterations)
+        return (second - first) / float(iterations)
+
+
+######################################################################
+# Reporting
+######################################################################
+
+def compare_results(results, baseline, threshold):
+    regressions = 0
+    for cfg_name, costs in results.items():
+        print("\n%s" % (cfg_name,))
+        base_costs = baseline.get(cfg_name, {})
+        for name, cost in costs.items():
+            line = "  %-14s %10.1f insns" % (name, cost)
+            base = base_costs.get(name)
+            if base:
+                change = (cost - base) / base * 100.
+                line += "  (%+.1f%% vs %.1f)" % (change, base)
+                if change > threshold:
+                    line += "  REGRESSION"
+                    regressions += 1
+            print(line)
+    return regressions
+
+def find_plugin(path):
+    if path is not None:
+        return path
+    for path in DEFAULT_PLUGIN_PATHS:
+        if os.path.exists(path):
+            return path
+    raise BenchError(
+        "Unable to locate the QEMU 'libinsn.so' plugin, use the --plugin "
+        "option to specify its location"
+    )
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Katapult QEMU micro-benchmarks"
+    )
+    parser.add_argument(
+        "configs", nargs="*", metavar="<config>",
+        help="Kconfig files to benchmark (default: %s)"
+        % (", ".join(DEFAULT_CONFIGS),)
+    )
+    parser.add_argument(
+        "-q", "--qemu", default="qemu-system-arm", metavar="<path>",
+        help="Path to qemu-system-arm"
+    )
+    parser.add_argument(
+        "-p", "--plugin", metavar="<path>",
+        help="Path to the QEMU libinsn.so TCG plugin"
+    )
+    parser.add_argument(
+        "-n", "--iterations", type=int, default=1000, metavar="<count>",
+        help="Iterations of each benchmark per run"
+    )
+    parser.add_argument(
+        "-o", "--out", metavar="<dir>",
+        help="Build directory (default: a temporary directory)"
+    )
+    parser.add_argument(
+        "-b", "--baseline", metavar="<json>",
+        help="Results of a previous run to compare against"
+    )
+    parser.add_argument(
+        "-s", "--save", metavar="<json>", help="Save results to a file"
+    )
+    parser.add_argument(
+        "-t", "--threshold", type=float, default=2., metavar="<percent>",
+        help="Cost increase reported as a regression"
+    )
+    parser.add_argument(
+        "-v", "--verbose", action="store_true", help="Show build output"
+    )
+    args = parser.parse_args()
+    configs = args.configs or DEFAULT_CONFIGS
+    baseline = {}
+    if args.baseline is not None:
+        with open(args.baseline, "r") as f:
+            baseline = json.load(f)
+    tmp_dir = None
+    out_base = args.out
+    if out_base is None:
+        tmp_dir = tempfile.TemporaryDirectory(prefix="katapult-bench-")
+        out_base = tmp_dir.name
+    results = {}
+    try:
+        plugin = find_plugin(args.plugin)
+        for cfg_path in configs:
+            cfg_name = os.path.splitext(os.path.basename(cfg_path))[0]
+            machine = find_machine(read_config(cfg_path))
+            if machine is None:
+                print("Skipping %s: no QEMU machine for this chip"
+                      % (cfg_name,))
+                continue
+            print("Building %s" % (cfg_name,))
+            out_dir = os.path.abspath(os.path.join(out_base, cfg_name))
+            image = build_image(cfg_path, out_dir, args.verbose)
+            runner = QemuRunner(args.qemu, plugin, machine, image)
+            costs = results[cfg_name] = {}
+            for name in runner.list_benchmarks():
+                print("  Running %s on %s" % (name, machine))
+                costs[name] = runner.measure(name, args.iterations)
+    except BenchError as e:
+        sys.stderr.write("%s\n" % (e,))
+        sys.exit(-1)
+    finally:
+        if tmp_dir is not None:
+            tmp_dir.cleanup()
+    regressions = compare_results(results, baseline, args.threshold)
+    if args.save is not None:
+        with open(args.save, "w") as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+    if regressions:
+        print("\n%d benchmark(s) regressed by more than %.1f%%"
+              % (regressions, args.threshold))
+        sys.exit(1)
+
+if __name__ == '__main__':
+    main()
@@ -270,6 +270,21 @@ Handlers.append(HandleStatusLED())
 # Button entry functionality
 ######################################################################
 
+# Parse an input pin with optional pullup ("^" or "~") and invert ("!")
+# prefixes.  Returns the gpio, the active state and the pullup setting.
+def parse_input_pin(pin):
+    pullup = 0
+    if pin[0] in "^~":
+        pullup = 1
+        if pin[0] == "~":
+            pullup = -1
+        pin = pin[1:].strip()
+    high = 1
+    if pin[0] == "!":
+        high = 0
+        pin = pin[1:].strip()
+    return HandlerConstants.lookup_pin(pin), high, pullup
+
 class HandleButton:
     def __init__(self):
         self.pin = None
@@ -281,18 +296,8 @@ class HandleButton:
         self.pin = pin
     def generate_code(self, options):
         button_gpio = button_high = button_pullup = 0
-        pin = self.pin
-        if pin:
-            if pin[0] in "^~":
-                button_pullup = 1
-                if pin[0] == "~":
-                    button_pullup = -1
-                pin = pin[1:].strip()
-            button_high = 1
-            if pin[0] == "!":
-                button_high = 0
-                pin = pin[1:].strip()
-            button_gpio = HandlerConstants.lookup_pin(pin)
+        if self.pin:
+            button_gpio, button_high, button_pullup = parse_input_pin(self.pin)
         fmt = """
 int32_t button_gpio = %d, button_high = %d, button_pullup = %d; // "%s"
 """
@@ -301,6 +306,43 @@ int32_t button_gpio = %d, button_high = %d, button_pullup = %d; // "%s"
 Handlers.append(HandleButton())
 
 
+######################################################################
+# SD card pins
+######################################################################
+
+class HandleSDCard:
+    def __init__(self):
+        self.pins = {}
+        self.ctr_dispatch = { 'DECL_SDCARD_PIN': self.decl_sdcard_pin }
+    def decl_sdcard_pin(self, req):
+        parts = req.split(None, 2)
+        pin = parts[2].strip() if len(parts) > 2 else ""
+        if pin.startswith('"') and pin.endswith('"'):
+            pin = pin[1:-1].strip()
+        self.pins[parts[1]] = pin
+    def generate_code(self, options):
+        names = ["SCK", "MOSI", "MISO", "CS"]
+        gpios = []
+        for name in names:
+            pin = self.pins.get(name)
+            gpios.append(HandlerConstants.lookup_pin(pin) if pin else 0)
+        # The card detect pin is optional
+        detect = self.pins.get("DETECT")
+        detect_gpio, detect_high, detect_pullup = -1, 0, 0
+        if detect:
+            detect_gpio, detect_high, detect_pullup = parse_input_pin(detect)
+        fmt = """
+uint32_t sdcard_gpio[4] = { %s }; // %s
+int32_t sdcard_detect_gpio = %d, sdcard_detect_high = %d;
+int32_t sdcard_detect_pullup = %d; // "%s"
+"""
+        return fmt % (", ".join(str(g) for g in gpios),
+                      ", ".join(self.pins.get(n, "") for n in names),
+                      detect_gpio, detect_high, detect_pullup, detect or "")
+
+Handlers.append(HandleSDCard())
+
+
 ######################################################################
 # Main code
 ######################################################################
@@ -7,6 +7,7 @@
 from __future__ import annotations
 import sys
 import os
+import time
 import termios
 import fcntl
 import zlib
@@ -22,7 +23,12 @@ import pathlib
 import shutil
 import shlex
 import contextlib
-from typing import Dict, List, Optional, Union, Any
+import ctypes
+import collections
+import binascii
+import re
+import contextvars
+from typing import Dict, List, Optional, Set, Union, Any, Callable, Tuple
 HAS_SERIAL = True
 try:
     from serial import Serial, SerialException
@@ -30,27 +36,47 @@ except ModuleNotFoundError:
     HAS_SERIAL = False
     SerialException = Exception
 
+# Name of the fleet target whose task is producing output.  Output from
+# concurrent targets is prefixed with the target name, progress bars
+# are suppressed.
+output_target: contextvars.ContextVar[str] = contextvars.ContextVar(
+    "output_target", default=""
+)
+
 def output_line(msg: str) -> None:
+    target = output_target.get()
+    if target:
+        lines = [line for line in msg.split("\n") if line.strip("[] ")]
+        msg = "\n".join([f"[{target}] {line}" for line in lines])
+        if not msg:
+            return
     sys.stdout.write(msg + "\n")
     sys.stdout.flush()
 
 def output(msg: str) -> None:
+    if output_target.get():
+        return
     sys.stdout.write(msg)
     sys.stdout.flush()
 
-# Standard crc16 ccitt, take from msgproto.py in Klipper
-def crc16_ccitt(buf: Union[bytes, bytearray]) -> int:
-    crc = 0xffff
-    for data in buf:
-        data ^= crc & 0xff
-        data ^= (data & 0x0f) << 4
-        crc = ((data << 8) | (crc >> 8)) ^ (data >> 4) ^ (data << 3)
-    return crc & 0xFFFF
+# Table that reverses the bit order of a byte
+BIT_REVERSE = bytes([int(f"{i:08b}"[::-1], 2) for i in range(256)])
+
+# Standard crc16 ccitt, as used by msgproto.py in Klipper.  This is the
+# bit reflected form of the crc computed by binascii.crc_hqx().
+def crc16_ccitt(buf: Union[bytes, bytearray, memoryview]) -> int:
+    crc = binascii.crc_hqx(bytes(buf).translate(BIT_REVERSE), 0xffff)
+    return BIT_REVERSE[crc & 0xff] << 8 | BIT_REVERSE[crc >> 8]
 
 
 logging.basicConfig(level=logging.INFO)
 CAN_FMT = "<IB3x8s"
+CAN_FRAME_SIZE = struct.calcsize(CAN_FMT)
 CAN_READER_LIMIT = 1024 * 1024
+CAN_READ_BATCH = 64
+CAN_TX_RETRY_MIN = .001
+CAN_TX_RETRY_MAX = .050
+ISOTP_MAX_PDU = 4095
 
 # Katapult Defs
 CMD_HEADER = b'\x01\x88'
@@ -61,13 +87,27 @@ BOOTLOADER_CMDS = {
     'SEND_EOF': 0x13,
     'REQUEST_BLOCK': 0x14,
     'COMPLETE': 0x15,
-    'GET_CANBUS_ID': 0x16
+    'GET_CANBUS_ID': 0x16,
+    'ECHO': 0x17,
+    'SET_BAUD': 0x18,
+    'UPDATE_BLOCK': 0x19,
+    'UPDATE_COMMIT': 0x1a,
+    'SWAP_BANK': 0x1b,
+    'READ_RANGE': 0x1c
 }
 
+COMPLETE_FLAG_KEEP_BANK = 0x01
+
 ACK_SUCCESS = 0xa0
 NACK = 0xf1
 ACK_ERROR = 0xf2
 ACK_BUSY = 0xf3
+RESPONSE_CODES = (ACK_SUCCESS, NACK, ACK_ERROR, ACK_BUSY)
+
+# Compact responses (CAN only), requested with a CONNECT flag
+CONNECT_FLAG_COMPACT = 0x01
+COMPACT_HEADER_SIZE = 2
+COMPACT_FRAME_MAX = 8
 
 # Klipper Admin Defs (for jumping to bootloader)
 KLIPPER_ADMIN_ID = 0x3f0
@@ -82,12 +122,23 @@ CANBUS_CMD_SET_NODEID = 0x11
 CANBUS_CMD_CLEAR_NODE_ID = 0x12
 CANBUS_RESP_NEED_NODEID = 0x20
 CANBUS_NODEID_OFFSET = 128
+# Nodes stagger query responses over ~8ms, a quiet bus after a response
+# means all nodes have answered
+QUERY_QUIET_TIME = .1
 
 # USB IDs
 KATAPULT_USB_ID = "1d50:6177"
 KLIPPER_USB_ID = "1d50:614e"
 GS_CAN_USB_ID = "1d50:606f"
 SERIAL_BL_REQ = b"~ \x1c Request Serial Bootloader!! ~"
+# Time Katapult waits for a command at a new baud rate before reverting
+BAUD_CONFIRM_TIME = 1.
+BAUD_TEST_PATTERN = bytes(range(0x55, 0x55 + 32))
+
+# Retransmission timeout limits (in seconds)
+RTO_INITIAL = 1.
+RTO_MIN = .1
+RTO_MAX = 5.
 
 class FlashError(Exception):
     pass
@@ -142,6 +193,181 @@ def get_stable_usb_symlink(device: pathlib.Path) -> pathlib.Path:
         pass
     return device_path
 
+# Linux usbfs definitions used by the direct USB bulk transport
+def _ioc(direction: int, nr: int, size: int) -> int:
+    return (direction << 30) | (size << 16) | (ord('U') << 8) | nr
+
+class UsbdevfsUrb(ctypes.Structure):
+    _fields_ = [
+        ("type", ctypes.c_ubyte),
+        ("endpoint", ctypes.c_ubyte),
+        ("status", ctypes.c_int),
+        ("flags", ctypes.c_uint),
+        ("buffer", ctypes.c_void_p),
+        ("buffer_length", ctypes.c_int),
+        ("actual_length", ctypes.c_int),
+        ("start_frame", ctypes.c_int),
+        ("number_of_packets", ctypes.c_int),
+        ("error_count", ctypes.c_int),
+        ("signr", ctypes.c_uint),
+        ("usercontext", ctypes.c_void_p),
+    ]
+
+class UsbdevfsIoctl(ctypes.Structure):
+    _fields_ = [
+        ("ifno", ctypes.c_int),
+        ("ioctl_code", ctypes.c_int),
+        ("data", ctypes.c_void_p),
+    ]
+
+USBDEVFS_URB_TYPE_BULK = 3
+USBDEVFS_SUBMITURB = _ioc(2, 10, ctypes.sizeof(UsbdevfsUrb))
+USBDEVFS_DISCARDURB = _ioc(0, 11, 0)
+USBDEVFS_REAPURBNDELAY = _ioc(1, 13, ctypes.sizeof(ctypes.c_void_p))
+USBDEVFS_CLAIMINTERFACE = _ioc(2, 15, ctypes.sizeof(ctypes.c_uint))
+USBDEVFS_RELEASEINTERFACE = _ioc(2, 16, ctypes.sizeof(ctypes.c_uint))
+USBDEVFS_IOCTL = _ioc(3, 18, ctypes.sizeof(UsbdevfsIoctl))
+USBDEVFS_DISCONNECT = _ioc(0, 22, 0)
+USBDEVFS_CONNECT = _ioc(0, 23, 0)
+USB_BULK_RX_URBS = 4
+USB_BULK_RX_SIZE = 512
+
+# Exchange frames with the bulk endpoints of the CDC data interface
+# through usbfs, bypassing the kernel tty layer.  Several receive
+# transfers are kept queued and writes are submitted without waiting
+# for completion.
+class UsbBulkTransport:
+    def __init__(
+        self, usb_path: pathlib.Path, data_cb: Callable[[bytes], None]
+    ) -> None:
+        self._loop = asyncio.get_running_loop()
+        self._data_cb = data_cb
+        self._libc = ctypes.CDLL(None, use_errno=True)
+        busnum = int(usb_path.joinpath("busnum").read_text())
+        devnum = int(usb_path.joinpath("devnum").read_text())
+        dev = f"/dev/bus/usb/{busnum:03d}/{devnum:03d}"
+        try:
+            self._fd = os.open(dev, os.O_RDWR | os.O_NONBLOCK)
+        except OSError as e:
+            raise FlashError(f"Unable to open usb device {dev}: {e}") from e
+        self._ifaces: List[int] = []
+        self._pending: Dict[int, Any] = {}
+        try:
+            self._ep_in, self._ep_out = self._find_endpoints()
+            for ifnum in self._ifaces:
+                self._detach_kernel_driver(ifnum)
+                self._ioctl(
+                    USBDEVFS_CLAIMINTERFACE, ctypes.byref(ctypes.c_uint(ifnum))
+                )
+            for _ in range(USB_BULK_RX_URBS):
+                self._submit(self._ep_in, bytearray(USB_BULK_RX_SIZE))
+        except Exception:
+            self.close()
+            raise
+        self._loop.add_writer(self._fd, self._reap)
+
+    def _ioctl(self, request: int, arg: Any) -> int:
+        ret = self._libc.ioctl(self._fd, ctypes.c_ulong(request), arg)
+        if ret < 0:
+            err = ctypes.get_errno()
+            raise OSError(err, os.strerror(err))
+        return ret
+
+    def _find_endpoints(self) -> Tuple[int, int]:
+        # Reading the usbfs node returns the device descriptor followed
+        # by the config descriptors
+        desc = os.pread(self._fd, 4096, 0)
+        pos = desc[0]
+        ep_in = ep_out = None
+        cur_iface: Optional[int] = None
+        data_iface = False
+        while pos + 2 <= len(desc) and desc[pos] >= 2:
+            length, dtype = desc[pos], desc[pos + 1]
+            if dtype == 0x04:
+                # Interface descriptor, CDC interfaces are claimed
+                cur_iface = desc[pos + 2]
+                if cur_iface not in self._ifaces:
+                    self._ifaces.append(cur_iface)
+                data_iface = desc[pos + 5] == 0x0a
+            elif dtype == 0x05 and data_iface and desc[pos + 3] & 0x03 == 2:
+                addr = desc[pos + 2]
+                if addr & 0x80:
+                    ep_in = addr
+                else:
+                    ep_out = addr
+            pos += length
+        if ep_in is None or ep_out is None:
+            raise FlashError("Unable to locate USB bulk endpoints")
+        return ep_in, ep_out
+
+    def _detach_kernel_driver(self, ifnum: int) -> None:
+        req = UsbdevfsIoctl(ifnum, USBDEVFS_DISCONNECT, None)
+        try:
+            self._ioctl(USBDEVFS_IOCTL, ctypes.byref(req))
+        except OSError as e:
+            if e.errno != errno.ENODATA:
+                raise
+
+    def _submit(self, endpoint: int, buf: bytearray) -> None:
+        cbuf = (ctypes.c_char * len(buf)).from_buffer(buf)
+        urb = UsbdevfsUrb()
+        urb.type = USBDEVFS_URB_TYPE_BULK
+        urb.endpoint = endpoint
+        urb.buffer = ctypes.addressof(cbuf)
+        urb.buffer_length = len(buf)
+        self._ioctl(USBDEVFS_SUBMITURB, ctypes.byref(urb))
+        self._pending[ctypes.addressof(urb)] = (urb, buf, cbuf)
+
+    def _reap(self) -> None:
+        while True:
+            urb_ptr = ctypes.c_void_p()
+            try:
+                self._ioctl(USBDEVFS_REAPURBNDELAY, ctypes.byref(urb_ptr))
+            except OSError as e:
+                if e.errno not in (errno.EAGAIN, errno.EWOULDBLOCK):
+                    logging.info(f"USB bulk transfer error: {e}")
+                    self._loop.remove_writer(self._fd)
+                return
+            urb, buf, _ = self._pending.pop(urb_ptr.value)
+            if urb.endpoint != self._ep_in:
+                if urb.status:
+                    logging.info(f"USB bulk write failed: {urb.status}")
+                continue
+            if urb.status == 0 and urb.actual_length:
+                self._data_cb(bytes(buf[:urb.actual_length]))
+            if urb.status in (0, -errno.EOVERFLOW):
+                self._submit(self._ep_in, buf)
+
+    def write(self, data: bytes) -> None:
+        self._submit(self._ep_out, bytearray(data))
+
+    def close(self) -> None:
+        if self._fd < 0:
+            return
+        self._loop.remove_writer(self._fd)
+        for urb, _, _ in list(self._pending.values()):
+            with contextlib.suppress(OSError):
+                self._ioctl(USBDEVFS_DISCARDURB, ctypes.byref(urb))
+        while self._pending:
+            urb_ptr = ctypes.c_void_p()
+            try:
+                self._ioctl(USBDEVFS_REAPURBNDELAY, ctypes.byref(urb_ptr))
+            except OSError:
+                break
+            self._pending.pop(urb_ptr.value, None)
+        for ifnum in self._ifaces:
+            with contextlib.suppress(OSError):
+                self._ioctl(
+                    USBDEVFS_RELEASEINTERFACE,
+                    ctypes.byref(ctypes.c_uint(ifnum))
+                )
+            # Reattach the cdc-acm driver
+            req = UsbdevfsIoctl(ifnum, USBDEVFS_CONNECT, None)
+            with contextlib.suppress(OSError):
+                self._ioctl(USBDEVFS_IOCTL, ctypes.byref(req))
+        os.close(self._fd)
+        self._fd = -1
+
 
 #  Python Port of fasthash6
 #  Host URL: http://github.com/ztanml/fast-hash
@@ -208,6 +434,292 @@ def convert_usbsn_to_uuid(serial_number: str) -> int:
         swapped |= ((result >> (i * 8)) & 0xFF) << ((5 - i) * 8)
     return swapped
 
+# Return the sysfs path of the Klipper USB-CAN bridge providing the
+# given interface, if that bridge has the given uuid
+def find_canbus_bridge(
+    can_interface: str, uuid: int
+) -> Optional[pathlib.Path]:
+    can_intf = can_interface.lower()
+    sysfs_usb_path = pathlib.Path("/sys/bus/usb/devices")
+    if not sysfs_usb_path.is_dir():
+        return None
+    for item in sysfs_usb_path.iterdir():
+        if not item.joinpath("bDeviceClass").is_file():
+            continue
+        usb_info = get_usb_info(item)
+        if (
+            usb_info["usb_id"] != GS_CAN_USB_ID or
+            usb_info["manufacturer"] != "klipper"
+        ):
+            continue
+        if not list(item.glob(f"{item.name}:*/net/{can_intf}")):
+            continue
+        # Klipper GS USB Device matches
+        serial_no = usb_info["serial_number"]
+        logging.info(
+            f"Found Klipper USB-CAN bridge on {can_intf}, serial {serial_no}"
+        )
+        if serial_no:
+            try:
+                det_uuid = convert_usbsn_to_uuid(serial_no)
+            except Exception:
+                output_line(
+                    f"Failed to convert can bridge serial number {serial_no} "
+                    f"to a uuid for device {item.name}"
+                )
+                logging.exception("UUID conversion failed")
+            else:
+                logging.info(
+                    f"Detected UUID: {det_uuid:x}, provided UUID: {uuid:x}"
+                )
+                if det_uuid == uuid:
+                    return item
+    return None
+
+class FirmwareImage:
+    # Analysis of a firmware image.  Results are cached in a sidecar file
+    # next to the image, keyed by the sha256 digest of the image contents,
+    # so flashing the same build again does not repeat the analysis.
+    CACHE_VERSION = 1
+    # CMF/FLG pairs of zlib streams using the default window size
+    ZLIB_HEADER_RE = re.compile(rb"\x78[\x01\x5e\x9c\xda]")
+
+    def __init__(self, path: pathlib.Path) -> None:
+        self.path = path
+        self.data = path.read_bytes()
+        self.digest = hashlib.sha256(self.data).hexdigest()
+        self.cache_path = path.with_name(path.name + ".katapult")
+        self.cache = self._load_cache()
+
+    def _load_cache(self) -> Dict[str, Any]:
+        try:
+            cache = json.loads(self.cache_path.read_text())
+        except (OSError, ValueError):
+            cache = None
+        if (
+            not isinstance(cache, dict) or
+            cache.get("version") != self.CACHE_VERSION or
+            cache.get("sha256") != self.digest
+        ):
+            cache = {"version": self.CACHE_VERSION, "sha256": self.digest}
+        return cache
+
+    def _save_cache(self) -> None:
+        try:
+            self.cache_path.write_text(json.dumps(self.cache))
+        except OSError:
+            logging.info(f"Unable to write image cache {self.cache_path}")
+
+    @property
+    def klipper_dict(self) -> Optional[Dict[str, Any]]:
+        if "klipper_dict" not in self.cache:
+            self.cache["klipper_dict"] = self._find_klipper_dict()
+            self._save_cache()
+        return self.cache["klipper_dict"]
+
+    def _find_klipper_dict(self) -> Optional[Dict[str, Any]]:
+        # The data dictionary is stored as a zlib stream, only offsets
+        # that start with a zlib header need to be inflated
+        view = memoryview(self.data)
+        for match in self.ZLIB_HEADER_RE.finditer(self.data):
+            try:
+                uncmp_data = zlib.decompressobj().decompress(
+                    view[match.start():]
+                )
+                klipper_dict = json.loads(uncmp_data)
+            except (zlib.error, ValueError):
+                continue
+            if (
+                isinstance(klipper_dict, dict) and
+                klipper_dict.get("app") == "Klipper"
+            ):
+                return klipper_dict
+        return None
+
+    def padded(self, block_size: int) -> bytes:
+        return self.data + b"\xFF" * (-len(self.data) % block_size)
+
+    def block_map(self, block_size: int) -> Dict[str, Any]:
+        # Digest and per block crc of the image when split into blocks
+        # of the given size
+        block_maps = self.cache.setdefault("block_maps", {})
+        key = str(block_size)
+        if key not in block_maps:
+            block_maps[key] = self._map_blocks(block_size)
+            self._save_cache()
+        return block_maps[key]
+
+    def _map_blocks(self, block_size: int) -> Dict[str, Any]:
+        data = self.padded(block_size)
+        view = memoryview(data)
+        count = len(data) // block_size
+        crcs = bytearray()
+        for idx in range(count):
+            block = view[idx * block_size:(idx + 1) * block_size]
+            crcs.extend(struct.pack("<H", crc16_ccitt(block)))
+        return {
+            "count": count,
+            "sha1": hashlib.sha1(data).hexdigest().upper(),
+            "crc16": crcs.hex()
+        }
+
+def build_frame(cmd: int, payload: bytes) -> bytearray:
+    if len(payload) % 4:
+        raise FlashError(
+            "Payload length %d is not a multiple of 4" % (len(payload),)
+        )
+    word_cnt = (len(payload) // 4) & 0xFF
+    out_cmd = bytearray(CMD_HEADER)
+    out_cmd.append(cmd)
+    out_cmd.append(word_cnt)
+    if payload:
+        out_cmd.extend(payload)
+    crc = crc16_ccitt(out_cmd[2:])
+    out_cmd.extend(struct.pack("<H", crc))
+    out_cmd.extend(CMD_TRAILER)
+    return out_cmd
+
+class FrameDecoder:
+    # Extract protocol frames from a stream of received data.  Data is
+    # accumulated in a single buffer and scanned once, consumed bytes
+    # are released when more data arrives.
+    def __init__(
+        self, frames: Optional[collections.deque[Tuple[int, int]]] = None
+    ) -> None:
+        self.buffer = bytearray()
+        self.pos = 0
+        # Stream offset of the start of the buffer, and the stream offset
+        # and length of each received CAN frame (when known)
+        self.offset = 0
+        self.frames = frames
+        self.compact = False
+
+    def feed(self, data: bytes) -> None:
+        if self.pos:
+            del self.buffer[:self.pos]
+            self.offset += self.pos
+            self.pos = 0
+        self.buffer.extend(data)
+        frames = self.frames
+        while frames and sum(frames[0]) <= self.offset:
+            frames.popleft()
+
+    def skip_partial(self) -> None:
+        # Abandon an incomplete frame, its header may have been noise
+        if self.pos < len(self.buffer):
+            self.pos += 1
+
+    def next_frame(self) -> Optional[bytes]:
+        if self.compact:
+            return self._next_compact_frame()
+        buf = self.buffer
+        view = memoryview(buf)
+        try:
+            while True:
+                start = buf.find(CMD_HEADER, self.pos)
+                if start < 0:
+                    # Keep a final byte that may start the next header
+                    self.pos = max(self.pos, len(buf) - 1)
+                    return None
+                self.pos = start
+                if len(buf) - start < 4:
+                    return None
+                end = start + buf[start + 3] * 4 + 8
+                if len(buf) < end:
+                    return None
+                if view[end - 2:end] != CMD_TRAILER:
+                    # Not a frame, resume the search after this header
+                    self.pos = start + 1
+                    continue
+                self.pos = end
+                return bytes(view[start:end])
+        finally:
+            view.release()
+
+    def _next_frame_start(self) -> Optional[int]:
+        # Each response starts in a new CAN frame, so after a lost frame
+        # the search resumes at a frame start rather than in the middle
+        # of a frame
+        frames = self.frames
+        if frames is None:
+            return self.pos
+        while frames and frames[0][0] < self.offset + self.pos:
+            frames.popleft()
+        if not frames:
+            self.pos = len(self.buffer)
+            return None
+        self.pos = min(frames[0][0] - self.offset, len(self.buffer))
+        return self.pos
+
+    def _next_compact_frame(self) -> Optional[bytes]:
+        # Compact responses are returned in the standard frame format.
+        # Standard frames may still arrive, such as the response to a
+        # retransmitted connect command.
+        buf = self.buffer
+        while True:
+            start = self._next_frame_start()
+            if start is None:
+                return None
+            avail = len(buf) - start
+            if avail < COMPACT_HEADER_SIZE:
+                return None
+            if buf[start:start + 2] == CMD_HEADER:
+                if avail < 4:
+                    return None
+                end = start + buf[start + 3] * 4 + 8
+                if len(buf) < end:
+                    return None
+                if buf[end - 2:end] == CMD_TRAILER:
+                    self.pos = end
+                    return bytes(buf[start:end])
+            elif buf[start] in RESPONSE_CODES:
+                data_end = end = start + COMPACT_HEADER_SIZE + buf[start + 1]
+                # Responses spanning several CAN frames carry a crc, a
+                # response without one must fill its frame exactly
+                if end - start > COMPACT_FRAME_MAX:
+                    end += 2
+                elif self.frames and self.frames[0][1] != end - start:
+                    self.pos = start + 1
+                    continue
+                if len(buf) < end:
+                    return None
+                data = bytes(buf[start:data_end])
+                crc = b""
+                if end > data_end:
+                    crc = struct.pack("<H", crc16_ccitt(data))
+                # The acked command id is sent as a single byte,
+                # followed by the word aligned payload
+                payload = data[COMPACT_HEADER_SIZE:]
+                aligned = not payload or len(payload) % 4 == 1
+                if aligned and buf[data_end:end] == crc:
+                    self.pos = end
+                    if payload:
+                        payload = struct.pack("<I", payload[0]) + payload[1:]
+                    return bytes(build_frame(data[0], payload))
+            # Not a response, resume the search at the next byte
+            self.pos = start + 1
+
+class RetransmitTimer:
+    # Estimate the command round trip time and compute a retransmission
+    # timeout from it, as described in RFC 6298
+    def __init__(self) -> None:
+        self.srtt: Optional[float] = None
+        self.rttvar = 0.
+        self.timeout = RTO_INITIAL
+
+    def update(self, rtt: float) -> None:
+        if self.srtt is None:
+            self.srtt = rtt
+            self.rttvar = rtt / 2.
+        else:
+            self.rttvar = .75 * self.rttvar + .25 * abs(self.srtt - rtt)
+            self.srtt = .875 * self.srtt + .125 * rtt
+        rto = self.srtt + 4. * self.rttvar
+        self.timeout = min(RTO_MAX, max(RTO_MIN, rto))
+
+    def backoff(self) -> None:
+        self.timeout = min(RTO_MAX, self.timeout * 2.)
+
 class CanFlasher:
     def __init__(
         self,
@@ -216,8 +728,12 @@ class CanFlasher:
     ) -> None:
         self.node = node
         self.firmware_path = fw_file
-        self.fw_sha = hashlib.sha1()
+        self.image: Optional[FirmwareImage] = None
+        self.fw_hex = ""
         self.primed = False
+        self.finished = False
+        self.rto = RetransmitTimer()
+        self.decoder = FrameDecoder(node.frames)
         self.file_size = 0
         self.block_size = 64
         self.block_count = 0
@@ -227,21 +743,12 @@ class CanFlasher:
 
     def _check_binary(self) -> None:
         """
-        Extract klipper.dict from binary
+        Analyze the firmware image and extract klipper.dict
         """
-        fw_name = self.firmware_path.name.lower()
-        if fw_name != "klipper.bin" or not self.firmware_path.is_file():
+        if not self.firmware_path.is_file():
             return
-        bin_data = self.firmware_path.read_bytes()
-        klipper_dict: Dict[str, Any] = {}
-        for idx in range(len(bin_data)):
-            try:
-                uncmp_data = zlib.decompress(bin_data[idx:])
-                klipper_dict = json.loads(uncmp_data)
-            except (zlib.error, json.JSONDecodeError):
-                continue
-            if klipper_dict.get("app") == "Klipper":
-                break
+        self.image = FirmwareImage(self.firmware_path)
+        klipper_dict = self.image.klipper_dict
         if klipper_dict:
             self.klipper_dict = klipper_dict
             ver = klipper_dict.get("version", "")
@@ -251,28 +758,24 @@ class CanFlasher:
             )
 
     def _build_command(self, cmd: int, payload: bytes) -> bytearray:
-        word_cnt = (len(payload) // 4) & 0xFF
-        out_cmd = bytearray(CMD_HEADER)
-        out_cmd.append(cmd)
-        out_cmd.append(word_cnt)
-        if payload:
-            out_cmd.extend(payload)
-        crc = crc16_ccitt(out_cmd[2:])
-        out_cmd.extend(struct.pack("<H", crc))
-        out_cmd.extend(CMD_TRAILER)
-        return out_cmd
+        return build_frame(cmd, payload)
 
     def prime(self) -> None:
         # Prime with an invalid command.  This will generate an error
         # and force double buffered USB devices to respond after the
-        # first command is sent.
+        # first command is sent.  Current versions of Katapult respond
+        # immediately, priming is only necessary for older bootloaders.
         msg = self._build_command(0x90, b"")
         self.node.write(msg)
         self.primed = True
 
-    async def connect_btl(self) -> None:
+    async def connect_btl(self, compact: bool = False) -> None:
         output_line("Attempting to connect to bootloader")
-        ret = await self.send_command('CONNECT')
+        # Bootloaders prior to protocol version 1.3.0 ignore the flags
+        payload = b""
+        if compact:
+            payload = struct.pack("<I", CONNECT_FLAG_COMPACT)
+        ret = await self.send_command('CONNECT', payload)
         pinfo = ret[:12]
         mcu_info = ret[12:]
         ver_bytes: bytes
@@ -293,6 +796,9 @@ class CanFlasher:
                 output_line("Katapult build not reporting software version!")
         else:
             mcu_type = mcu_info.decode()
+        if compact and self.proto_version >= (1, 3, 0):
+            self.decoder.compact = True
+            logging.info("Using compact responses")
         output_line(
             f"Katapult Connected\n"
             f"Software Version: {self.software_version}\n"
@@ -318,154 +824,222 @@ class CanFlasher:
         if mcu_uuid != uuid:
             raise FlashError("UUID mismatch (%s vs %s)" % (uuid, mcu_uuid))
 
+    async def link_test(self, count: int) -> None:
+        if self.proto_version < (1, 2, 0):
+            raise FlashError(
+                "Link test requires Katapult protocol version 1.2.0 or later"
+            )
+        count = max(1, count)
+        max_len = self.block_size + 4
+        output_line(f"Running link test ({count} requests per payload size)")
+        # Payloads are sent in 4 byte words
+        for length in sorted({0, 16, (max_len // 2) & ~3, max_len}):
+            payload = bytes([i & 0xFF for i in range(length)])
+            rtts: List[float] = []
+            start_time = time.monotonic()
+            for _ in range(count):
+                req_time = time.monotonic()
+                resp = await self.send_command('ECHO', payload)
+                rtts.append(time.monotonic() - req_time)
+                if resp != payload:
+                    raise FlashError("Echo response payload mismatch")
+            elapsed = time.monotonic() - start_time
+            # Each exchange sends 8 framing bytes, receives 12 (3 for
+            # compact responses, plus a crc when over one CAN frame)
+            resp_len = length + 12
+            if self.decoder.compact:
+                resp_len = length + 3
+                if resp_len > COMPACT_FRAME_MAX:
+                    resp_len += 2
+            wire_bytes = (2 * length + 8 + resp_len) * count
+            output_line(
+                f"Payload {length:3d} bytes: "
+                f"rtt min {min(rtts) * 1000.:.2f} ms, "
+                f"avg {sum(rtts) / count * 1000.:.2f} ms, "
+                f"max {max(rtts) * 1000.:.2f} ms, "
+                f"throughput {2 * length * count / elapsed / 1024.:.1f} KiB/s "
+                f"({wire_bytes / elapsed / 1024.:.1f} KiB/s on wire)"
+            )
+
+    async def _read_frame(self, timeout: float) -> bytes:
+        eventloop = asyncio.get_running_loop()
+        deadline = eventloop.time() + timeout
+        while True:
+            frame = self.decoder.next_frame()
+            if frame is not None:
+                return frame
+            remaining = deadline - eventloop.time()
+            if remaining <= 0.:
+                raise asyncio.TimeoutError()
+            data = await self.node.read(4096, remaining)
+            if not data:
+                raise EOFError("Device connection closed")
+            self.decoder.feed(data)
+
     async def send_command(
         self,
         cmdname: str,
         payload: bytes = b"",
         tries: int = 5,
-        read_timeout: float = 2.0
+        read_timeout: float = 2.0,
+        expect: bytes = b""
     ) -> bytearray:
         cmd = BOOTLOADER_CMDS[cmdname]
         out_cmd = self._build_command(cmd, payload)
-        last_err = Exception()
+        eventloop = asyncio.get_running_loop()
+        # Retransmit whenever the retransmission timeout expires, until
+        # the command has failed "tries" times or the overall time limit
+        # has been reached
+        deadline = eventloop.time() + tries * read_timeout
+        retransmitted = False
         while tries:
-            data = bytearray()
-            recd_len = 0
+            now = eventloop.time()
+            if now >= deadline:
+                break
+            self.node.write(out_cmd)
+            send_time = now
+            wait_time = min(self.rto.timeout, read_timeout, deadline - now)
             try:
-                self.node.write(out_cmd)
-                read_done = False
-                while not read_done:
-                    ret = await self.node.readuntil(CMD_TRAILER, read_timeout)
-                    data.extend(ret)
-                    while len(data) > 7:
-                        if data[:2] != CMD_HEADER:
-                            data = data[1:]
-                            continue
-                        recd_len = data[3] * 4
-                        read_done = len(data) == recd_len + 8
-                        break
-                    if self.primed and read_done:
-                        recd_len = 0
-                        data.clear()
+                while True:
+                    data = await self._read_frame(
+                        wait_time - (eventloop.time() - send_time)
+                    )
+                    if self.primed:
+                        # Discard the response to the priming command
                         self.primed = False
-                        read_done = False
+                        continue
+                    frame = memoryview(data)
+                    recd_len = data[3] * 4
+                    recd_crc, = struct.unpack_from("<H", data, recd_len + 4)
+                    calc_crc = crc16_ccitt(frame[2:recd_len + 4])
+                    recd_ack = data[2]
+                    cmd_response = 0
+                    if recd_len:
+                        cmd_response, = struct.unpack_from("<I", data, 4)
+                    resp = bytearray(frame[8:recd_len + 4])
+                    if recd_crc != calc_crc:
+                        logging.info(
+                            f"Command '{cmdname}': Frame CRC Mismatch, "
+                            f"expected: {calc_crc}, received {recd_crc}"
+                        )
+                    elif recd_ack == ACK_ERROR:
+                        logging.info(
+                            f"Command '{cmdname}': Received Error Response"
+                        )
+                    elif recd_ack == ACK_BUSY:
+                        logging.info(
+                            f"Command '{cmdname}': Received busy signal"
+                        )
+                        await asyncio.sleep(self.rto.timeout)
+                    elif recd_ack != ACK_SUCCESS:
+                        logging.info(f"Command '{cmdname}': Received NACK")
+                    elif cmd_response != cmd or resp[:len(expect)] != expect:
+                        # A late response to an earlier (retransmitted)
+                        # request, keep waiting for the current response
+                        logging.info(
+                            f"Command '{cmdname}': Discarding stale response "
+                            f"to command 0x{cmd_response:2x}"
+                        )
+                        continue
+                    else:
+                        # Validation passed, return payload sans command.
+                        # Only unambiguous round trips update the estimate.
+                        if not retransmitted:
+                            self.rto.update(eventloop.time() - send_time)
+                        return resp
+                    # Retransmit immediately on a corrupt or error response
+                    break
             except asyncio.CancelledError:
                 raise
             except asyncio.TimeoutError:
                 logging.info(
-                    f"Response for command {cmdname} timed out, "
-                    f"{tries - 1} tries remaining"
+                    f"Response for command {cmdname} timed out after "
+                    f"{wait_time:.3f}s, retransmitting"
                 )
-            except Exception as e:
-                if type(e) is type(last_err) and e.args == last_err.args:
-                    last_err = e
-                    logging.exception("Device Read Error")
+                self.rto.backoff()
+                self.decoder.skip_partial()
+            except Exception:
+                logging.exception("Device Read Error")
+                tries -= 1
             else:
-                trailer = data[-2:]
-                recd_crc, = struct.unpack("<H", data[-4:-2])
-                calc_crc = crc16_ccitt(data[2:-4])
-                recd_ack = data[2]
-                cmd_response = 0
-                if recd_len:
-                    cmd_response, = struct.unpack("<I", data[4:8])
-                if trailer != CMD_TRAILER:
-                    logging.info(
-                        f"Command '{cmdname}': Invalid Trailer Received "
-                        f"0x{trailer.hex()}"
-                    )
-                elif recd_crc != calc_crc:
-                    logging.info(
-                        f"Command '{cmdname}': Frame CRC Mismatch, expected: "
-                        f"{calc_crc}, received {recd_crc}"
-                    )
-                elif recd_ack == ACK_ERROR:
-                    logging.info(f"Command '{cmdname}': Received Error Response")
-                elif recd_ack == ACK_BUSY:
-                    logging.info(f"Command '{cmdname}': Received busy signal")
-                    await asyncio.sleep(1.5)
-                elif recd_ack != ACK_SUCCESS:
-                    logging.info(f"Command '{cmdname}': Received NACK")
-                elif cmd_response != cmd:
-                    logging.info(
-                        f"Command '{cmdname}': Acknowledged wrong command, "
-                        f"expected: {cmd:2x}, received: {cmd_response:2x}"
-                    )
-                else:
-                    # Validation passed, return payload sans command
-                    if recd_len <= 4:
-                        return bytearray()
-                    return data[8:recd_len + 4]
-            tries -= 1
-            # clear the read buffer
-            try:
-                ret = await self.node.read(1024, timeout=.25)
-            except asyncio.TimeoutError:
-                pass
-            else:
-                logging.info(f"Read Buffer Contents: {ret!r}")
-            await asyncio.sleep(.5)
+                tries -= 1
+            retransmitted = True
         raise FlashError("Error sending command [%s] to Device" % (cmdname))
 
     async def send_file(self):
         last_percent = 0
         output_line("Flashing '%s'..." % (self.firmware_path))
+        if self.image is None:
+            raise FlashError(
+                "Invalid firmware path '%s'" % (self.firmware_path)
+            )
+        block_map = self.image.block_map(self.block_size)
+        logging.info(
+            f"Image {self.image.digest[:16]}: {block_map['count']} blocks"
+        )
+        self.fw_hex = block_map["sha1"]
+        image = memoryview(self.image.padded(self.block_size))
+        self.file_size = len(self.image.data)
         output("\n[")
-        with open(self.firmware_path, 'rb') as f:
-            f.seek(0, os.SEEK_END)
-            self.file_size = f.tell()
-            f.seek(0)
-            flash_address = self.app_start_addr
-            recd_addr = 0
-            while True:
-                buf = f.read(self.block_size)
-                if not buf:
-                    break
-                if len(buf) < self.block_size:
-                    buf += b"\xFF" * (self.block_size - len(buf))
-                self.fw_sha.update(buf)
-                prefix = struct.pack("<I", flash_address)
-                for _ in range(3):
-                    try:
-                        resp = await self.send_command(
-                            'SEND_BLOCK', prefix + buf, 3, 5.0
-                        )
-                    except FlashError as e:
-                        raise FlashError(
-                            f"Flash write failed, flash address 0x{flash_address:4X}"
-                        ) from e
-                    recd_addr, = struct.unpack("<I", resp)
-                    if recd_addr == flash_address:
-                        break
-                    logging.info(
-                        f"Block write mismatch: expected: {flash_address:4X}, "
-                        f"received: {recd_addr:4X}"
+        flash_address = self.app_start_addr
+        recd_addr = 0
+        for offset in range(0, len(image), self.block_size):
+            buf = image[offset:offset + self.block_size]
+            prefix = struct.pack("<I", flash_address)
+            for _ in range(3):
+                try:
+                    resp = await self.send_command(
+                        'SEND_BLOCK', prefix + buf, 3, 5.0, prefix
                     )
-                    await asyncio.sleep(.1)
-                else:
+                except FlashError as e:
                     raise FlashError(
-                        f"Flash write failed, block address 0x{recd_addr:4X}"
-                    )
-                flash_address += self.block_size
-                self.block_count += 1
-                uploaded = self.block_count * self.block_size
-                pct = int(uploaded / float(self.file_size) * 100 + .5)
-                if pct >= last_percent + 2:
-                    last_percent += 2.
-                    output("#")
-            resp = await self.send_command('SEND_EOF')
-            page_count, = struct.unpack("<I", resp)
-            output_line("]\n\nWrite complete: %d pages" % (page_count))
+                        f"Flash write failed, flash address 0x{flash_address:4X}"
+                    ) from e
+                recd_addr, = struct.unpack("<I", resp)
+                if recd_addr == flash_address:
+                    break
+                logging.info(
+                    f"Block write mismatch: expected: {flash_address:4X}, "
+                    f"received: {recd_addr:4X}"
+                )
+            else:
+                raise FlashError(
+                    f"Flash write failed, block address 0x{recd_addr:4X}"
+                )
+            flash_address += self.block_size
+            self.block_count += 1
+            uploaded = self.block_count * self.block_size
+            pct = int(uploaded / float(self.file_size) * 100 + .5)
+            if pct >= last_percent + 2:
+                last_percent += 2.
+                output("#")
+        # Request the count of unchanged pages, older versions of
+        # Katapult ignore the payload and only report the page count
+        resp = await self.send_command('SEND_EOF', struct.pack("<I", 1))
+        page_count, = struct.unpack("<I", resp[:4])
+        msg = "]\n\nWrite complete: %d pages" % (page_count)
+        if len(resp) >= 8:
+            skipped, = struct.unpack("<I", resp[4:8])
+            if skipped:
+                msg += " (%d unchanged)" % (skipped)
+        output_line(msg)
 
     async def verify_file(self):
         last_percent = 0
         output_line("Verifying (block count = %d)..." % (self.block_count,))
         output("\n[")
         ver_sha = hashlib.sha1()
+        block_crcs: Optional[bytes] = None
+        if self.image is not None:
+            block_map = self.image.block_map(self.block_size)
+            block_crcs = bytes.fromhex(block_map["crc16"])
         for i in range(self.block_count):
             flash_address = i * self.block_size + self.app_start_addr
             for _ in range(3):
                 payload = struct.pack("<I", flash_address)
-                resp = await self.send_command("REQUEST_BLOCK", payload)
+                resp = await self.send_command(
+                    "REQUEST_BLOCK", payload, expect=payload
+                )
                 recd_addr, = struct.unpack("<I", resp[:4])
                 if recd_addr == flash_address:
                     break
@@ -473,24 +1047,181 @@ class CanFlasher:
                     f"Block read mismatch: expected: 0x{flash_address:4X}, "
                     f"received: 0x{recd_addr}"
                 )
-                await asyncio.sleep(.1)
             else:
                 output_line("Error")
                 raise FlashError("Block Request Error, block: %d" % (i,))
+            # Stop at the first block that doesn't match the image
+            if block_crcs is not None:
+                exp_crc, = struct.unpack_from("<H", block_crcs, i * 2)
+                if crc16_ccitt(resp[4:]) != exp_crc:
+                    output_line("Error")
+                    raise FlashError(
+                        f"Verification failed at block {i}, flash address "
+                        f"0x{flash_address:4X}"
+                    )
             ver_sha.update(resp[4:])
             pct = int(i * self.block_size / float(self.file_size) * 100 + .5)
             if pct >= last_percent + 2:
                 last_percent += 2
                 output("#")
         ver_hex = ver_sha.hexdigest().upper()
-        fw_hex = self.fw_sha.hexdigest().upper()
+        fw_hex = self.fw_hex
         if ver_hex != fw_hex:
             raise FlashError("Checksum mismatch: Expected %s, Received %s"
                                 % (fw_hex, ver_hex))
         output_line("]\n\nVerification Complete: SHA = %s" % (ver_hex))
 
-    async def finish(self):
-        await self.send_command("COMPLETE")
+    async def backup_firmware(self, out_path: pathlib.Path) -> None:
+        # The device streams the requested range without waiting for
+        # a request per block.  Blocks must arrive in order, a gap or
+        # a stall restarts the stream at the first missing block.
+        cmd = BOOTLOADER_CMDS['READ_RANGE']
+        address = self.app_start_addr
+        end_addr: Optional[int] = None
+        image = bytearray()
+        eventloop = asyncio.get_running_loop()
+        output_line(f"Reading application to '{out_path}'...")
+        output("\n[")
+        tries = 5
+        last_percent = 0
+        while end_addr is None or address < end_addr:
+            if not tries:
+                raise FlashError(
+                    f"Firmware backup failed, flash address 0x{address:4X}"
+                )
+            request = self._build_command(
+                cmd, struct.pack("<II", address, 0xFFFFFFFF)
+            )
+            self.node.write(request)
+            req_address = address
+            deadline = eventloop.time() + max(self.rto.timeout, .5)
+            while end_addr is None or address < end_addr:
+                try:
+                    data = await self._read_frame(
+                        deadline - eventloop.time()
+                    )
+                except asyncio.TimeoutError:
+                    self.decoder.skip_partial()
+                    break
+                recd_len = data[3] * 4
+                recd_crc, = struct.unpack_from("<H", data, recd_len + 4)
+                if recd_crc != crc16_ccitt(memoryview(data)[2:recd_len + 4]):
+                    logging.info("Read Range: Frame CRC Mismatch")
+                    break
+                if data[2] == ACK_ERROR:
+                    if end_addr is None:
+                        raise FlashError(
+                            "Range read rejected.  The device may not "
+                            "support firmware backups."
+                        )
+                    break
+                if data[2] != ACK_SUCCESS or recd_len < 12:
+                    continue
+                cmd_response, recd_addr = struct.unpack_from("<II", data, 4)
+                if cmd_response != cmd:
+                    continue
+                if recd_len == 12:
+                    # Start of stream response, reports the range end
+                    if recd_addr == req_address:
+                        end_addr, = struct.unpack_from("<I", data, 12)
+                    continue
+                if recd_addr != address or end_addr is None:
+                    # Stale frame from an earlier stream
+                    continue
+                image.extend(data[12:recd_len + 4])
+                address += self.block_size
+                deadline = eventloop.time() + max(self.rto.timeout, .5)
+                tries = 5
+                total = end_addr - self.app_start_addr
+                pct = int((address - self.app_start_addr) / total * 100 + .5)
+                if pct >= last_percent + 2:
+                    last_percent += 2
+                    output("#")
+            else:
+                break
+            logging.info(
+                f"Read Range: stream stalled at 0x{address:4X}, restarting"
+            )
+            self.rto.backoff()
+            tries -= 1
+        # Erased flash past the end of the application isn't saved
+        image_len = len(image.rstrip(b"\xFF"))
+        image_len += -image_len % self.block_size
+        out_path.write_bytes(image[:image_len])
+        ver_hex = hashlib.sha1(image[:image_len]).hexdigest().upper()
+        output_line(
+            f"]\n\nBackup Complete: {image_len} bytes, SHA = {ver_hex}"
+        )
+
+    async def update_bootloader(self, image_path: pathlib.Path) -> None:
+        if not image_path.is_file():
+            raise FlashError("Invalid bootloader path '%s'" % (image_path))
+        image = bytearray(image_path.read_bytes())
+        if b"CanBoot!" not in image:
+            raise FlashError(f"File '{image_path}' is not a Katapult image")
+        image += b"\xFF" * (-len(image) % self.block_size)
+        output_line(f"Staging bootloader '{image_path}'...")
+        output("\n[")
+        last_percent = 0
+        for offset in range(0, len(image), self.block_size):
+            buf = image[offset:offset + self.block_size]
+            prefix = struct.pack("<I", offset)
+            for _ in range(3):
+                resp = await self.send_command(
+                    'UPDATE_BLOCK', prefix + buf, expect=prefix
+                )
+                recd_offset, = struct.unpack("<I", resp)
+                if recd_offset == offset:
+                    break
+                logging.info(
+                    f"Staged block mismatch: expected: 0x{offset:4X}, "
+                    f"received: 0x{recd_offset:4X}"
+                )
+            else:
+                raise FlashError(
+                    f"Bootloader staging failed, offset 0x{offset:4X}"
+                )
+            pct = int((offset + len(buf)) / float(len(image)) * 100 + .5)
+            if pct >= last_percent + 2:
+                last_percent += 2
+                output("#")
+        output_line("]\n")
+        # The device verifies the staged image before rewriting the
+        # bootloader, then resets into the new bootloader
+        payload = struct.pack("<II", len(image), crc16_ccitt(image))
+        try:
+            await self.send_command('UPDATE_COMMIT', payload, 2)
+        except FlashError as e:
+            raise FlashError(
+                "Bootloader update rejected.  The device may not support "
+                "updates, the image does not fit, or it was built for a "
+                "different MCU or flash start address."
+            ) from e
+        output_line(
+            f"Bootloader update committed: {len(image)} bytes, device "
+            "is restarting into the new bootloader"
+        )
+
+    async def swap_bank(self) -> None:
+        output_line("Requesting flash bank swap")
+        try:
+            await self.send_command('SWAP_BANK', tries=2)
+        except FlashError as e:
+            raise FlashError(
+                "Bank swap rejected.  The device may not support bank "
+                "swapping or the inactive bank has no application."
+            ) from e
+        output_line("Device is restarting from the inactive flash bank")
+
+    async def finish(self, keep_bank: bool = False) -> None:
+        # An image written to the inactive flash bank is booted unless
+        # the previous application is kept, bootloaders without bank
+        # swapping ignore the flag
+        payload = b""
+        if keep_bank:
+            payload = struct.pack("<I", COMPLETE_FLAG_KEEP_BANK)
+        await self.send_command("COMPLETE", payload)
+        self.finished = True
 
 
 class CanNode:
@@ -498,6 +1229,10 @@ class CanNode:
         self.node_id = node_id
         self._reader = asyncio.StreamReader(CAN_READER_LIMIT)
         self._cansocket = cansocket
+        # Stream offset and length of each fed CAN frame, recorded when
+        # data is fed one raw CAN frame at a time
+        self.frames: Optional[collections.deque[Tuple[int, int]]] = None
+        self.fed = 0
 
     async def read(
         self, n: int = -1, timeout: Optional[float] = 2.
@@ -529,6 +1264,9 @@ class CanNode:
         return await self.readexactly(resp_length, timeout)
 
     def feed_data(self, data: bytes) -> None:
+        if self.frames is not None and data:
+            self.frames.append((self.fed, len(data)))
+        self.fed += len(data)
         self._reader.feed_data(data)
 
     def close(self) -> None:
@@ -544,6 +1282,8 @@ class BaseSocket:
     def is_flash_req(self) -> bool:
         return not (
             self.is_bootloader_req or self.is_status_req or self.is_query
+            or self.is_link_test or self.is_bootloader_update
+            or self.is_swap_bank or self.is_backup
         )
 
     @property
@@ -558,6 +1298,22 @@ class BaseSocket:
     def is_query(self) -> bool:
         return self._args.query
 
+    @property
+    def is_link_test(self) -> bool:
+        return self._args.link_test is not None
+
+    @property
+    def is_bootloader_update(self) -> bool:
+        return self._args.update_bootloader is not None
+
+    @property
+    def is_swap_bank(self) -> bool:
+        return self._args.swap_bank
+
+    @property
+    def is_backup(self) -> bool:
+        return self._args.backup is not None
+
     @property
     def is_usb_can_bridge(self) -> bool:
         return False
@@ -600,9 +1356,12 @@ class CanSocket(BaseSocket):
             CANBUS_ID_ADMIN_RESP: self.admin_node
         }
 
-        self.input_buffer = b""
-        self.output_packets: List[bytes] = []
-        self.input_busy = False
+        self.read_buffer = bytearray(CAN_FRAME_SIZE)
+        self.isotp_sock: Optional[socket.socket] = None
+        self.isotp_node: Optional[CanNode] = None
+        self.output_packets: collections.deque[
+            Tuple[socket.socket, bytes]
+        ] = collections.deque()
         self.output_busy = False
         self.closed = True
 
@@ -626,32 +1385,77 @@ class CanSocket(BaseSocket):
         self._can_bridge_serial_path = tty_path
         return tty_path
 
+    def _update_filters(self) -> None:
+        # Only deliver standard data frames addressed to the admin
+        # response id or to an assigned node
+        mask = socket.CAN_SFF_MASK | socket.CAN_EFF_FLAG | socket.CAN_RTR_FLAG
+        filters = b"".join(
+            [struct.pack("<II", can_id, mask) for can_id in self.nodes]
+        )
+        try:
+            self.cansock.setsockopt(
+                socket.SOL_CAN_RAW, socket.CAN_RAW_FILTER, filters
+            )
+        except OSError:
+            logging.exception("Unable to set CAN filters")
+
     def _handle_can_response(self) -> None:
+        # Process all frames queued on the socket in a single pass
+        buf = self.read_buffer
+        for _ in range(CAN_READ_BATCH):
+            try:
+                length = self.cansock.recv_into(buf)
+            except BlockingIOError:
+                return
+            except socket.error as e:
+                # If bad file descriptor allow connection to be
+                # closed by the data check
+                if e.errno == errno.EBADF:
+                    logging.exception("Can Socket Read Error, closing")
+                    length = 0
+                else:
+                    return
+            if not length:
+                # socket closed
+                self.close()
+                return
+            if length == CAN_FRAME_SIZE:
+                self._process_packet(buf)
+
+    def _open_isotp(self, node: CanNode) -> None:
+        # Segmentation and flow control of node traffic is handled by
+        # the kernel, the raw socket is only used for admin messages
+        isotp_proto = getattr(socket, "CAN_ISOTP", None)
+        if isotp_proto is None:
+            raise FlashError("ISO-TP sockets are not supported on this host")
         try:
-            data = self.cansock.recv(4096)
-        except socket.error as e:
-            # If bad file descriptor allow connection to be
-            # closed by the data check
-            if e.errno == errno.EBADF:
-                logging.exception("Can Socket Read Error, closing")
-                data = b''
-            else:
+            sock = socket.socket(socket.PF_CAN, socket.SOCK_DGRAM, isotp_proto)
+            sock.bind((self._can_interface, node.node_id + 1, node.node_id))
+        except OSError as e:
+            raise FlashError(
+                "Unable to open ISO-TP socket (is the can-isotp module "
+                "loaded?)"
+            ) from e
+        sock.setblocking(False)
+        self.isotp_sock = sock
+        self.isotp_node = node
+        self._loop.add_reader(sock.fileno(), self._handle_isotp_response)
+
+    def _handle_isotp_response(self) -> None:
+        assert self.isotp_sock is not None and self.isotp_node is not None
+        for _ in range(CAN_READ_BATCH):
+            try:
+                data = self.isotp_sock.recv(ISOTP_MAX_PDU)
+            except BlockingIOError:
                 return
-        if not data:
-            # socket closed
-            self.close()
-            return
-        self.input_buffer += data
-        if self.input_busy:
-            return
-        self.input_busy = True
-        while len(self.input_buffer) >= 16:
-            packet = self.input_buffer[:16]
-            self._process_packet(packet)
-            self.input_buffer = self.input_buffer[16:]
-        self.input_busy = False
-
-    def _process_packet(self, packet: bytes) -> None:
+            except socket.error:
+                # Reception errors (such as a timed out transfer)
+                # are recovered by command retransmission
+                logging.exception("ISO-TP Socket Read Error")
+                return
+            self.isotp_node.feed_data(data)
+
+    def _process_packet(self, packet: bytes | bytearray) -> None:
         can_id, length, data = struct.unpack(CAN_FMT, packet)
         can_id &= socket.CAN_EFF_MASK
         payload = data[:length]
@@ -660,33 +1464,60 @@ class CanSocket(BaseSocket):
             node.feed_data(payload)
 
     def send(self, can_id: int, payload: bytes = b"") -> None:
-        if can_id > 0x7FF:
-            can_id |= socket.CAN_EFF_FLAG
-        if not payload:
-            packet = struct.pack(CAN_FMT, can_id, 0, b"")
-            self.output_packets.append(packet)
+        node = self.isotp_node
+        if self.isotp_sock is not None and node is not None and \
+                can_id == node.node_id:
+            while payload:
+                self.output_packets.append(
+                    (self.isotp_sock, payload[:ISOTP_MAX_PDU])
+                )
+                payload = payload[ISOTP_MAX_PDU:]
         else:
+            if can_id > 0x7FF:
+                can_id |= socket.CAN_EFF_FLAG
+            if not payload:
+                packet = struct.pack(CAN_FMT, can_id, 0, b"")
+                self.output_packets.append((self.cansock, packet))
             while payload:
                 length = min(len(payload), 8)
                 pkt_data = payload[:length]
                 payload = payload[length:]
                 packet = struct.pack(
                     CAN_FMT, can_id, length, pkt_data)
-                self.output_packets.append(packet)
+                self.output_packets.append((self.cansock, packet))
         if self.output_busy:
             return
         self.output_busy = True
         asyncio.create_task(self._do_can_send())
 
     async def _do_can_send(self):
-        while self.output_packets:
-            packet = self.output_packets.pop(0)
+        # Frames are written without yielding until the kernel transmit
+        # queue fills, then sending backs off until space is available
+        retry_delay = CAN_TX_RETRY_MIN
+        while self.output_packets and not self.closed:
+            sock, packet = self.output_packets[0]
             try:
-                await self._loop.sock_sendall(self.cansock, packet)
-            except socket.error:
-                logging.info("Socket Write Error, closing")
-                self.close()
-                break
+                sock.send(packet)
+            except (BlockingIOError, InterruptedError):
+                pass
+            except socket.error as e:
+                if sock is self.isotp_sock and e.errno != errno.ENOBUFS:
+                    # The error belongs to a failed ISO-TP transfer, which
+                    # is recovered by command retransmission
+                    logging.info(f"ISO-TP Write Error: {e}")
+                    self.output_packets.popleft()
+                    continue
+                if e.errno != errno.ENOBUFS:
+                    logging.info("Socket Write Error, closing")
+                    self.close()
+                    break
+            else:
+                self.output_packets.popleft()
+                retry_delay = CAN_TX_RETRY_MIN
+                continue
+            # Transmit queue full
+            await asyncio.sleep(retry_delay)
+            retry_delay = min(CAN_TX_RETRY_MAX, retry_delay * 2.)
         self.output_busy = False
 
     def _jump_to_bootloader(self, uuid: int):
@@ -699,14 +1530,24 @@ class CanSocket(BaseSocket):
         output_line("Checking for Katapult nodes...")
         payload = bytes([CANBUS_CMD_QUERY_UNASSIGNED])
         self.admin_node.write(payload)
+        # Stop early once the expected number of nodes has responded,
+        # or once the bus has been quiet for a while after a response
+        expected: Optional[int] = self._args.expect_nodes
         curtime = self._loop.time()
         endtime = curtime + 2.
         self.uuids: List[int] = []
+        detected: Set[bytes] = set()
         while curtime < endtime:
-            timeout = max(.1, endtime - curtime)
+            if expected is not None and len(detected) >= expected:
+                break
+            timeout = endtime - curtime
+            if detected:
+                timeout = min(timeout, QUERY_QUIET_TIME)
             try:
                 resp = await self.admin_node.read(8, timeout)
             except asyncio.TimeoutError:
+                if detected:
+                    break
                 continue
             finally:
                 curtime = self._loop.time()
@@ -720,9 +1561,12 @@ class CanSocket(BaseSocket):
             if len(resp) > 7:
                 app = app_names.get(resp[7], "Unknown")
             data = resp[1:7]
+            if data in detected:
+                continue
+            detected.add(data)
             output_line(f"Detected UUID: {data.hex()}, Application: {app}")
             uuid = sum([v << ((5 - i) * 8) for i, v in enumerate(data)])
-            if uuid not in self.uuids and app == "Katapult":
+            if app == "Katapult":
                 self.uuids.append(uuid)
         return self.uuids
 
@@ -741,47 +1585,19 @@ class CanSocket(BaseSocket):
         self.admin_node.write(payload)
         decoded_id = node_id * 2 + 0x100
         node = CanNode(decoded_id, self)
-        self.nodes[decoded_id + 1] = node
+        if self._args.isotp:
+            self._open_isotp(node)
+        else:
+            node.frames = collections.deque()
+            self.nodes[decoded_id + 1] = node
+            self._update_filters()
         return node
 
     def _search_canbus_bridge(self) -> None:
-        can_intf = self._can_interface.lower()
-        sysfs_usb_path = pathlib.Path("/sys/bus/usb/devices")
-        if not sysfs_usb_path.is_dir():
-            return
-        for item in sysfs_usb_path.iterdir():
-            if not item.joinpath("bDeviceClass").is_file():
-                continue
-            usb_info = get_usb_info(item)
-            if (
-                usb_info["usb_id"] != GS_CAN_USB_ID or
-                usb_info["manufacturer"] != "klipper"
-            ):
-                continue
-            if not list(item.glob(f"{item.name}:*/net/{can_intf}")):
-                continue
-            # Klipper GS USB Device matches
-            serial_no = usb_info["serial_number"]
-            logging.info(
-                f"Found Klipper USB-CAN bridge on {can_intf}, serial {serial_no}"
-            )
-            if serial_no:
-                try:
-                    det_uuid = convert_usbsn_to_uuid(serial_no)
-                except Exception:
-                    output_line(
-                        f"Failed to convert can bridge serial number {serial_no} "
-                        f"to a uuid for device {item.name}"
-                    )
-                    logging.exception("UUID conversion failed")
-                else:
-                    logging.info(
-                        f"Detected UUID: {det_uuid:x}, provided UUID: {self._uuid:x}"
-                    )
-                    if det_uuid == self._uuid:
-                        self._can_bridge_path = item
-                        output_line(f"Canbus Bridge detected at {item}")
-                        break
+        bridge_path = find_canbus_bridge(self._can_interface, self._uuid)
+        if bridge_path is not None:
+            self._can_bridge_path = bridge_path
+            output_line(f"Canbus Bridge detected at {bridge_path}")
 
     async def _wait_canbridge_reset(self) -> None:
         if self._can_bridge_path is None:
@@ -817,6 +1633,7 @@ class CanSocket(BaseSocket):
             raise FlashError(f"Unable to bind socket to {self._can_interface}")
         self.closed = False
         self.cansock.setblocking(False)
+        self._update_filters()
         self._loop.add_reader(
             self.cansock.fileno(), self._handle_can_response)
         if self.is_flash_req or self.is_bootloader_req:
@@ -837,17 +1654,31 @@ class CanSocket(BaseSocket):
         flasher = CanFlasher(node, self._fw_path)
         await asyncio.sleep(.5)
         try:
-            await flasher.connect_btl()
+            await flasher.connect_btl(compact=True)
             await flasher.verify_canbus_uuid(self._uuid)
-            if not self.is_status_req:
+            if self.is_link_test:
+                await flasher.link_test(self._args.link_test)
+            elif self.is_swap_bank:
+                await flasher.swap_bank()
+            elif self.is_backup:
+                await flasher.backup_firmware(
+                    pathlib.Path(self._args.backup).expanduser()
+                )
+            elif self.is_bootloader_update:
+                await flasher.update_bootloader(
+                    pathlib.Path(self._args.update_bootloader).expanduser()
+                )
+            elif not self.is_status_req:
                 await flasher.send_file()
                 await flasher.verify_file()
+                await flasher.finish()
         finally:
             # always attempt to send the complete command. If
             # there is an error it will exit the bootloader
-            # unless comms were broken
-            if self.is_flash_req:
-                await flasher.finish()
+            # unless comms were broken.  An unverified image in the
+            # inactive flash bank is not booted.
+            if self.is_flash_req and not flasher.finished:
+                await flasher.finish(keep_bank=True)
 
     def close(self):
         if self.closed:
@@ -855,6 +1686,12 @@ class CanSocket(BaseSocket):
         self.closed = True
         for node in self.nodes.values():
             node.close()
+        if self.isotp_sock is not None:
+            assert self.isotp_node is not None
+            self.isotp_node.close()
+            self._loop.remove_reader(self.isotp_sock.fileno())
+            self.isotp_sock.close()
+            self.isotp_sock = None
         self._loop.remove_reader(self.cansock.fileno())
         self.cansock.close()
 
@@ -878,6 +1715,7 @@ class SerialSocket(BaseSocket):
             )
         output_line(f"Connecting to Serial Device {self._device}, baud {self._baud}")
         self.serial: Optional[Serial] = None
+        self.usb_bulk: Optional[UsbBulkTransport] = None
         self.node = CanNode(0, self)
 
     @property
@@ -899,6 +1737,13 @@ class SerialSocket(BaseSocket):
             self.node.feed_data(data)
 
     def send(self, can_id: int, payload: bytes = b"") -> None:
+        if self.usb_bulk is not None:
+            try:
+                self.usb_bulk.write(payload)
+            except OSError:
+                logging.exception("Error on usb bulk write")
+                self.close()
+            return
         assert self.serial is not None
         try:
             self.serial.write(payload)
@@ -1029,6 +1874,50 @@ class SerialSocket(BaseSocket):
             raise FlashError("Unable to open serial port: %s" % (e,))
         return serial_dev
 
+    async def _change_baud(self, flasher: CanFlasher, baud: int) -> None:
+        assert self.serial is not None
+        orig_baud = self.serial.baudrate
+        if flasher.proto_version < (1, 2, 0):
+            output_line("Katapult does not support baud rate changes")
+            return
+        output_line(f"Requesting baud rate change to {baud}")
+        try:
+            resp = await flasher.send_command(
+                'SET_BAUD', struct.pack("<I", baud), tries=1
+            )
+        except FlashError:
+            output_line(
+                f"Baud rate {baud} not supported, continuing at {orig_baud}"
+            )
+            return
+        dev_baud, = struct.unpack("<I", resp[:4])
+        # Allow Katapult to finish transmitting at the original rate
+        await asyncio.sleep(.05)
+        self.serial.baudrate = baud
+        try:
+            await flasher.send_command(
+                'ECHO', BAUD_TEST_PATTERN, tries=2, read_timeout=.25
+            )
+        except FlashError:
+            pass
+        else:
+            output_line(f"Baud rate changed (device rate {dev_baud})")
+            return
+        output_line(f"Baud rate {baud} failed, reverting to {orig_baud}")
+        self.serial.baudrate = orig_baud
+        await asyncio.sleep(BAUD_CONFIRM_TIME)
+        try:
+            await flasher.send_command('ECHO', BAUD_TEST_PATTERN, tries=2)
+        except FlashError:
+            # Katapult accepted the new rate, explicitly switch it back
+            self.serial.baudrate = baud
+            await flasher.send_command(
+                'SET_BAUD', struct.pack("<I", orig_baud), tries=2
+            )
+            await asyncio.sleep(.05)
+            self.serial.baudrate = orig_baud
+            await flasher.send_command('ECHO', BAUD_TEST_PATTERN)
+
     def _has_double_buffering(self, product: str) -> bool:
         if product.startswith("stm32"):
             variant = product[5:7]
@@ -1064,36 +1953,61 @@ class SerialSocket(BaseSocket):
             return
         else:
             usb_prod = ""
-        self.serial = self._open_device(device, self._baud)
-        self._loop.add_reader(self.serial.fileno(), self._handle_response)
+        if self._args.usb_bulk:
+            bulk_path = get_usb_path(pathlib.Path(device))
+            if bulk_path is None:
+                raise FlashError(f"Device {device} is not a USB device")
+            output_line("Using direct USB bulk transfers")
+            self.usb_bulk = UsbBulkTransport(bulk_path, self.node.feed_data)
+        else:
+            self.serial = self._open_device(device, self._baud)
+            self._loop.add_reader(self.serial.fileno(), self._handle_response)
         flasher = CanFlasher(self.node, self._fw_path)
         try:
             if self._has_double_buffering(usb_prod):
                 # Prime the USB Connection with a dummy command.  This is
-                # necessary to get STM32 devices with usbfs double buffering
-                # to respond immediately to the connect command.
+                # necessary to get STM32 devices running older versions of
+                # Katapult with usbfs double buffering to respond immediately
+                # to the connect command.  The error response is discarded.
                 flasher.prime()
             await flasher.connect_btl()
-            if not self.is_status_req:
+            if self._args.change_baud and usb_dev_path is None:
+                await self._change_baud(flasher, self._args.change_baud)
+            if self.is_link_test:
+                await flasher.link_test(self._args.link_test)
+            elif self.is_swap_bank:
+                await flasher.swap_bank()
+            elif self.is_backup:
+                await flasher.backup_firmware(
+                    pathlib.Path(self._args.backup).expanduser()
+                )
+            elif self.is_bootloader_update:
+                await flasher.update_bootloader(
+                    pathlib.Path(self._args.update_bootloader).expanduser()
+                )
+            elif not self.is_status_req:
                 await flasher.send_file()
                 await flasher.verify_file()
+                await flasher.finish()
         finally:
             # always attempt to send the complete command. If
             # there is an error it will exit the bootloader
-            # unless comms were broken
-            if self.is_flash_req:
-                await flasher.finish()
+            # unless comms were broken.  An unverified image in the
+            # inactive flash bank is not booted.
+            if self.is_flash_req and not flasher.finished:
+                await flasher.finish(keep_bank=True)
 
     def close(self):
+        if self.usb_bulk is not None:
+            self.usb_bulk.close()
+            self.usb_bulk = None
         if self.serial is None:
             return
         self._loop.remove_reader(self.serial.fileno())
         self.serial.close()
         self.serial = None
 
-async def main(args: argparse.Namespace) -> int:
-    if not args.verbose:
-        logging.getLogger().setLevel(logging.ERROR)
+async def run_target(args: argparse.Namespace) -> BaseSocket:
     iscan = args.device is None
     sock: CanSocket | SerialSocket | None = None
     try:
@@ -1107,13 +2021,147 @@ async def main(args: argparse.Namespace) -> int:
             sock.close()
             sock = SerialSocket(args)
             await sock.run()
-    except Exception:
-        logging.exception("Flash Tool Error")
-        return 1
     finally:
         if sock is not None:
             sock.close()
-    if sock is None:
+    return sock
+
+# Types accepted for each manifest target field
+MANIFEST_FIELDS: Dict[str, Tuple[type, ...]] = {
+    "name": (str,), "firmware": (str,), "device": (str,), "baud": (int,),
+    "interface": (str,), "uuid": (str,), "isotp": (bool,), "bridge": (bool,)
+}
+
+def check_manifest_target(target: Dict[str, Any], name: str) -> None:
+    for key, val in target.items():
+        types = MANIFEST_FIELDS.get(key)
+        if types is None:
+            raise FlashError(f"Manifest target {name}: unknown field '{key}'")
+        # bool is a subclass of int, don't accept it for integer fields
+        if not isinstance(val, types) or (
+            isinstance(val, bool) and bool not in types
+        ):
+            raise FlashError(
+                f"Manifest target {name}: field '{key}' must be of type "
+                f"{types[0].__name__}"
+            )
+    if ("device" in target) == ("uuid" in target):
+        raise FlashError(
+            f"Manifest target {name} must specify one of 'device' or 'uuid'"
+        )
+    if "uuid" in target:
+        try:
+            int(target["uuid"], 16)
+        except ValueError:
+            raise FlashError(
+                f"Manifest target {name}: invalid uuid '{target['uuid']}'"
+            ) from None
+
+def load_manifest(
+    args: argparse.Namespace
+) -> Dict[Tuple[str, str], List[argparse.Namespace]]:
+    # Group the manifest targets by link.  Targets on the same serial
+    # device or CAN interface must be flashed one at a time, separate
+    # links are flashed concurrently.
+    manifest_path = pathlib.Path(args.manifest).expanduser()
+    try:
+        manifest = json.loads(manifest_path.read_text())
+    except (OSError, ValueError) as e:
+        raise FlashError(f"Unable to load manifest '{manifest_path}'") from e
+    if isinstance(manifest, dict):
+        manifest = manifest.get("targets")
+    if not isinstance(manifest, list) or not manifest:
+        raise FlashError(f"Manifest '{manifest_path}' lists no targets")
+    links: Dict[Tuple[str, str], List[argparse.Namespace]] = {}
+    bridges: Dict[str, bool] = {}
+    for idx, target in enumerate(manifest):
+        if not isinstance(target, dict):
+            raise FlashError(f"Manifest target {idx} is not an object")
+        name = target.get("name")
+        check_manifest_target(
+            target, repr(name) if isinstance(name, str) else str(idx)
+        )
+        targ_args = argparse.Namespace(**vars(args))
+        targ_args.manifest = None
+        targ_args.firmware = target.get("firmware", args.firmware)
+        if "device" in target:
+            targ_args.device = target["device"]
+            targ_args.baud = target.get("baud", args.baud)
+            dev = pathlib.Path(target["device"]).expanduser()
+            link = ("serial", str(dev.resolve()))
+            name = target.get("name", target["device"])
+        else:
+            targ_args.device = None
+            targ_args.interface = target.get("interface", args.interface)
+            targ_args.uuid = target["uuid"]
+            targ_args.isotp = target.get("isotp", args.isotp)
+            link = ("can", targ_args.interface)
+            name = target.get("name", f"{targ_args.interface}:{target['uuid']}")
+            is_bridge = target.get("bridge")
+            if is_bridge is None:
+                bridge_path = find_canbus_bridge(
+                    targ_args.interface, int(target["uuid"], 16)
+                )
+                is_bridge = bridge_path is not None
+            bridges[name] = bool(is_bridge)
+        targ_args.name = name
+        links.setdefault(link, []).append(targ_args)
+    # Flashing a USB-CAN bridge takes down its CAN interface, so bridges
+    # are flashed after the other nodes on the interface
+    for targets in links.values():
+        targets.sort(key=lambda t: bridges.get(t.name, False))
+    return links
+
+async def run_fleet(args: argparse.Namespace) -> int:
+    links = load_manifest(args)
+    eventloop = asyncio.get_running_loop()
+    results: List[Tuple[str, bool, float]] = []
+
+    async def run_link(targets: List[argparse.Namespace]) -> None:
+        for targ_args in targets:
+            output_target.set(targ_args.name)
+            start_time = eventloop.time()
+            try:
+                await run_target(targ_args)
+            except Exception as e:
+                logging.exception(f"Flash Tool Error ({targ_args.name})")
+                output_line(f"Failed: {e}")
+                success = False
+            else:
+                output_line("Complete")
+                success = True
+            results.append(
+                (targ_args.name, success, eventloop.time() - start_time)
+            )
+
+    count = sum([len(t) for t in links.values()])
+    output_line(f"Flashing {count} targets over {len(links)} links")
+    start_time = eventloop.time()
+    await asyncio.gather(*[run_link(t) for t in links.values()])
+    output_line("\nFleet Summary:")
+    for name, success, elapsed in results:
+        status = "OK" if success else "FAILED"
+        output_line(f"  {name}: {status} ({elapsed:.1f}s)")
+    failed = len([r for r in results if not r[1]])
+    output_line(
+        f"{count - failed} of {count} targets succeeded in "
+        f"{eventloop.time() - start_time:.1f}s"
+    )
+    return 1 if failed else 0
+
+async def main(args: argparse.Namespace) -> int:
+    if not args.verbose:
+        logging.getLogger().setLevel(logging.ERROR)
+    if args.manifest is not None:
+        try:
+            return await run_fleet(args)
+        except FlashError:
+            logging.exception("Flash Tool Error")
+            return 1
+    try:
+        sock = await run_target(args)
+    except Exception:
+        logging.exception("Flash Tool Error")
         return 1
     if sock.is_query:
         output_line("CANBus UUID Query Complete")
@@ -1121,6 +2169,14 @@ async def main(args: argparse.Namespace) -> int:
         output_line("Bootloader Request Complete")
     elif sock.is_status_req:
         output_line("Status Request Complete")
+    elif sock.is_link_test:
+        output_line("Link Test Complete")
+    elif sock.is_bootloader_update:
+        output_line("Bootloader Update Complete")
+    elif sock.is_swap_bank:
+        output_line("Bank Swap Complete")
+    elif sock.is_backup:
+        output_line("Firmware Backup Complete")
     else:
         output_line("Programming Complete")
     return 0
@@ -1137,10 +2193,22 @@ if __name__ == '__main__':
         "-b", "--baud", default=250000, metavar='<baud rate>',
         help="Serial baud rate"
     )
+    parser.add_argument(
+        "-c", "--change-baud", metavar='<baud rate>', type=int, default=None,
+        help="Request a faster baud rate after connecting (UART only)"
+    )
+    parser.add_argument(
+        "--usb-bulk", action="store_true",
+        help="Use direct USB bulk transfers instead of the tty (USB only)"
+    )
     parser.add_argument(
         "-i", "--interface", default="can0", metavar='<can interface>',
         help="Can Interface"
     )
+    parser.add_argument(
+        "--isotp", action="store_true",
+        help="Use ISO-TP framing (requires bootloader support, CAN only)"
+    )
     parser.add_argument(
         "-f", "--firmware", metavar="<klipper.bin>",
         default="~/klipper/out/klipper.bin",
@@ -1153,6 +2221,10 @@ if __name__ == '__main__':
         "-q", "--query", action="store_true",
         help="Query available CAN UUIDs (CANBus Ony)"
     )
+    parser.add_argument(
+        "--expect-nodes", metavar="<count>", type=int, default=None,
+        help="Finish a UUID query once this many nodes have responded"
+    )
     parser.add_argument(
         "-v", "--verbose", action="store_true",
         help="Enable verbose responses"
@@ -1165,5 +2237,27 @@ if __name__ == '__main__':
         "-s", "--status", action="store_true",
         help="Connect to bootloader and print status"
     )
+    parser.add_argument(
+        "-l", "--link-test", metavar="<count>", nargs="?", type=int,
+        const=100, default=None,
+        help="Measure link latency and throughput using echo requests"
+    )
+    parser.add_argument(
+        "-B", "--update-bootloader", metavar="<katapult.bin>", default=None,
+        help="Replace the bootloader in place (requires bootloader support)"
+    )
+    parser.add_argument(
+        "--swap-bank", action="store_true",
+        help="Boot the application in the inactive flash bank"
+    )
+    parser.add_argument(
+        "--backup", metavar="<out.bin>", default=None,
+        help="Save the application currently in flash to a file"
+    )
+    parser.add_argument(
+        "-M", "--manifest", metavar="<manifest.json>", default=None,
+        help="Flash all targets listed in a manifest, concurrently where "
+        "they are on separate links"
+    )
     args = parser.parse_args()
     exit(asyncio.run(main(args)))
@@ -54,12 +54,20 @@ check_double_reset(void)
 int
 bootentry_check(void)
 {
+    // Install an image from an SD card or one staged by the
+    // application.  Remain in the bootloader if the copy fails.
+    int staged = 0;
+    if (CONFIG_ENABLE_SDCARD)
+        staged = sdcard_install();
+    if (CONFIG_ENABLE_STAGED_IMAGE && staged >= 0)
+        staged = staged_image_install();
     // Enter the bootloader in the following conditions:
     // - The request signature is set in memory (request from app)
     // - No application code is present
+    // - A staged image could not be installed
     uint64_t bootup_code = get_bootup_code();
     if (bootup_code == REQUEST_CANBOOT || !application_check_valid()
-        || check_button_pressed()) {
+        || staged < 0 || check_button_pressed()) {
         // Start bootloader main loop
         set_bootup_code(0);
         return 1;
@@ -3,5 +3,8 @@
 
 int bootentry_check(void);
 int board_check_double_reset(void);
+void board_reset_flags_clear(void);
+int staged_image_install(void);
+int sdcard_install(void);
 
 #endif // bootentry.h
@@ -0,0 +1,106 @@
+// Command handlers for in place bootloader updates
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <string.h> // memcpy, strncmp
+#include "autoconf.h" // CONFIG_BLOCK_SIZE
+#include "board/flash.h" // flash_write_bootloader
+#include "board/misc.h" // dynmem_start
+#include "byteorder.h" // cpu_to_le32
+#include "canboot.h" // CANBOOT_SIGNATURE
+#include "command.h" // command_respond_ack
+#include "sched.h" // DECL_TASK
+
+#define BOOTLOADER_SIZE (CONFIG_LAUNCH_APP_ADDRESS - CONFIG_FLASH_START)
+
+static uint8_t update_pending;
+static uint32_t update_size, update_endtime;
+
+// Return the number of bytes that may be staged in ram
+static uint32_t
+staging_size(void)
+{
+    uint32_t avail = dynmem_end() - dynmem_start();
+    if (avail > BOOTLOADER_SIZE)
+        avail = BOOTLOADER_SIZE;
+    return ALIGN_DOWN(avail, CONFIG_BLOCK_SIZE);
+}
+
+// Store a block of the new bootloader in the ram staging area
+void
+command_update_block(uint32_t *data)
+{
+    if (update_pending
+        || command_get_arg_count(data) != (CONFIG_BLOCK_SIZE / 4) + 1)
+        goto fail;
+    uint32_t offset = le32_to_cpu(data[1]);
+    if (offset & (CONFIG_BLOCK_SIZE - 1) || offset >= staging_size())
+        goto fail;
+    memcpy(dynmem_start() + offset, &data[2], CONFIG_BLOCK_SIZE);
+    uint32_t out[4];
+    out[2] = cpu_to_le32(offset);
+    command_respond_ack(CMD_UPDATE_BLOCK, out, ARRAY_SIZE(out));
+    return;
+fail:
+    command_respond_command_error();
+}
+
+// Check that a staged image is a bootloader built for this chip
+static int
+check_image(uint32_t *image, uint32_t size)
+{
+    uint32_t sp = image[0], reset = image[1] & ~1;
+    if (sp <= CONFIG_RAM_START || sp > CONFIG_RAM_START + CONFIG_RAM_SIZE)
+        return 0;
+    struct canboot_image_info *info;
+    uint32_t pos = reset - CONFIG_FLASH_START;
+    if (reset < CONFIG_FLASH_START + sizeof(*info) || pos >= size
+        || pos & 7)
+        return 0;
+    // The reset handler is preceded by the mcu and flash start the
+    // image was built for, and the bootloader signature
+    info = (void*)image + pos - sizeof(*info);
+    return (info->signature == CANBOOT_SIGNATURE
+            && info->flash_start == CONFIG_FLASH_START
+            && !strncmp(info->mcu, CONFIG_MCU, sizeof(info->mcu)));
+}
+
+// Verify the staged image and schedule the bootloader rewrite
+void
+command_update_commit(uint32_t *data)
+{
+    if (update_pending || command_get_arg_count(data) != 2)
+        goto fail;
+    uint32_t size = le32_to_cpu(data[1]);
+    uint16_t crc = le32_to_cpu(data[2]);
+    if (!size || size & (CONFIG_BLOCK_SIZE - 1) || size > staging_size())
+        goto fail;
+    uint32_t *image = dynmem_start();
+    if (crc16_ccitt_update(0xffff, (void*)image, size) != crc
+        || !check_image(image, size))
+        goto fail;
+    uint32_t out[4];
+    out[2] = cpu_to_le32(size);
+    command_respond_ack(CMD_UPDATE_COMMIT, out, ARRAY_SIZE(out));
+    // Delay the write so that the response can be transmitted
+    update_size = size;
+    update_pending = 1;
+    update_endtime = timer_read_time() + timer_from_us(100000);
+    return;
+fail:
+    command_respond_command_error();
+}
+
+void
+bootupdate_task(void)
+{
+    if (!update_pending
+        || !timer_is_before(update_endtime, timer_read_time()))
+        return;
+    // Remain in the new bootloader after the reset
+    set_bootup_code(REQUEST_CANBOOT);
+    flash_write_bootloader(dynmem_start(), update_size);
+}
+DECL_TASK(bootupdate_task);
@@ -7,13 +7,44 @@
 #define REQUEST_CANBOOT 0x5984E3FA6CA1589B
 #define REQUEST_START_APP 0x7b06ec45a9a8243d
 
+// Build details stored in front of the reset handler
+struct canboot_image_info {
+    char mcu[28];
+    uint32_t flash_start;
+    uint64_t signature;
+};
+
 uint64_t get_bootup_code(void);
 void set_bootup_code(uint64_t code);
 void application_read_flash(uint32_t address, uint32_t *dest);
 int application_check_valid(void);
 void application_jump(void);
 
+uint32_t flash_bank_read_address(uint32_t address);
+int flash_bank_request_swap(void);
+void flash_bank_cancel_swap(void);
+void flash_bank_commit(void);
+uint32_t flash_get_skipped_pages(void);
+
 void udelay(uint32_t usecs);
 void timer_setup(void);
 
+// Boot phase timestamps left in backup registers for the application
+#define BOOT_TIMESTAMPS_SIGNATURE 0x454d4954 // TIME
+enum {
+    BOOT_PHASE_MAIN,    // board and clock setup complete
+    BOOT_PHASE_ENTRY,   // bootloader entry check complete
+    BOOT_PHASE_APP,     // application about to be started
+    BOOT_PHASE_COUNT,
+};
+struct boot_timestamps {
+    uint32_t signature;
+    uint32_t clock_freq;
+    uint32_t reset_cause;
+    uint32_t phase_cycles[BOOT_PHASE_COUNT];
+};
+void boot_timestamps_start(void);
+void boot_timestamp_record(int phase);
+void boot_timestamps_set_reset_cause(uint32_t cause);
+
 #endif // canboot.h
@@ -18,6 +18,40 @@ command_encode_and_frame(uint8_t *buf, const struct command_encoder *ce
     return ce->max_size;
 }
 
+// Encode a framed response in the compact format.  The acked command
+// id is sent as a single byte.
+uint_fast8_t
+command_encode_compact(uint8_t *buf, const struct command_encoder *ce)
+{
+    uint8_t *frame = (uint8_t*)ce->data;
+    uint_fast8_t words = frame[MESSAGE_POS_LEN], len = 0;
+    buf[0] = frame[MESSAGE_POS_LEN - 1];
+    if (words) {
+        len = (words - 1) * 4 + 1;
+        buf[COMPACT_HEADER_SIZE] = frame[MESSAGE_HEADER_SIZE];
+        memcpy(&buf[COMPACT_HEADER_SIZE + 1], &frame[MESSAGE_HEADER_SIZE + 4]
+               , len - 1);
+    }
+    buf[1] = len;
+    len += COMPACT_HEADER_SIZE;
+    if (len > COMPACT_FRAME_MAX) {
+        uint16_t crc = crc16_ccitt(buf, len);
+        buf[len++] = crc;
+        buf[len++] = crc >> 8;
+    }
+    return len;
+}
+
+// Return the size of an encoded response in either format
+uint_fast8_t
+command_response_size(uint8_t *buf)
+{
+    if (buf[MESSAGE_POS_STX1] == MESSAGE_STX1)
+        return buf[MESSAGE_POS_LEN] * 4 + MESSAGE_MIN;
+    uint_fast8_t len = buf[1] + COMPACT_HEADER_SIZE;
+    return len > COMPACT_FRAME_MAX ? len + COMPACT_CRC_SIZE : len;
+}
+
 static void
 command_respond(uint32_t *data, uint32_t cmdid, uint32_t data_len)
 {
@@ -81,6 +115,36 @@ command_dispatch(uint8_t *buf, uint_fast8_t msglen)
         case CMD_COMPLETE:
             command_complete(data);
             break;
+        case CMD_ECHO:
+            command_echo(data);
+            break;
+        case CMD_SET_BAUD:
+            if (CONFIG_SERIAL_BAUD_CHANGE) {
+                command_set_baud(data);
+                break;
+            }
+            command_respond_command_error();
+            break;
+        case CMD_UPDATE_BLOCK:
+            if (CONFIG_ENABLE_BOOTLOADER_UPDATE) {
+                command_update_block(data);
+                break;
+            }
+            command_respond_command_error();
+            break;
+        case CMD_UPDATE_COMMIT:
+            if (CONFIG_ENABLE_BOOTLOADER_UPDATE) {
+                command_update_commit(data);
+                break;
+            }
+            command_respond_command_error();
+            break;
+        case CMD_SWAP_BANK:
+            command_swap_bank(data);
+            break;
+        case CMD_READ_RANGE:
+            command_read_range(data);
+            break;
         case CMD_GET_CANBUS_ID:
             if (CONFIG_CANSERIAL) {
                 command_get_canbus_id(data);
@@ -23,13 +23,20 @@
 #define shutdown(msg)     do { } while (1)
 #define try_shutdown(msg) do { } while (0)
 
-#define PROTO_VERSION   0x00010100      // Version 1.1.0
+#define PROTO_VERSION   0x00010300      // Version 1.3.0
 #define CMD_CONNECT       0x11
 #define CMD_RX_BLOCK      0x12
 #define CMD_RX_EOF        0x13
 #define CMD_REQ_BLOCK     0x14
 #define CMD_COMPLETE      0x15
 #define CMD_GET_CANBUS_ID 0x16
+#define CMD_ECHO          0x17
+#define CMD_SET_BAUD      0x18
+#define CMD_UPDATE_BLOCK  0x19
+#define CMD_UPDATE_COMMIT 0x1a
+#define CMD_SWAP_BANK     0x1b
+#define CMD_READ_RANGE    0x1c
+#define COMPLETE_FLAG_KEEP_BANK 0x01
 #define RESPONSE_ACK           0xa0
 #define RESPONSE_NACK          0xf1
 #define RESPONSE_COMMAND_ERROR 0xf2
@@ -51,6 +58,15 @@
 #define MESSAGE_SYNC2 0x99
 #define MESSAGE_SYNC  0x03
 
+// Compact Response Format (negotiated on CAN):
+// <1 byte response> <1 byte data length> <data> <2 byte crc>
+// The crc is omitted when the response fits in a single CAN frame.
+// Each response starts in a new CAN frame.
+#define CONNECT_FLAG_COMPACT 0x01
+#define COMPACT_HEADER_SIZE 2
+#define COMPACT_CRC_SIZE 2
+#define COMPACT_FRAME_MAX 8
+
 // command handlers
 void command_connect(uint32_t *data);
 void command_read_block(uint32_t *data);
@@ -58,6 +74,12 @@ void command_write_block(uint32_t *data);
 void command_eof(uint32_t *data);
 void command_complete(uint32_t *data);
 void command_get_canbus_id(uint32_t *data);
+void command_echo(uint32_t *data);
+void command_set_baud(uint32_t *data);
+void command_update_block(uint32_t *data);
+void command_update_commit(uint32_t *data);
+void command_swap_bank(uint32_t *data);
+void command_read_range(uint32_t *data);
 
 // command.c
 void command_respond_ack(uint32_t acked_cmd, uint32_t *out, uint32_t out_len);
@@ -70,6 +92,9 @@ struct command_encoder {
 };
 uint_fast8_t command_encode_and_frame(
     uint8_t *buf, const struct command_encoder *ce, va_list args);
+uint_fast8_t command_encode_compact(uint8_t *buf
+                                   , const struct command_encoder *ce);
+uint_fast8_t command_response_size(uint8_t *buf);
 int_fast8_t command_find_block(uint8_t *buf, uint_fast8_t buf_len
                                , uint_fast8_t *pop_count);
 void command_dispatch(uint8_t *buf, uint_fast8_t msglen);
@@ -11,6 +11,7 @@
 #include "board/io.h" // readb
 #include "board/misc.h" // timer_read_time
 #include "canboot.h" // timer_setup
+#include "compiler.h" // __visible
 #include "deployer.h" // deployer_is_active
 #include "sched.h" // sched_check_periodic
 
@@ -53,6 +54,10 @@ sched_check_wake(struct task_wake *w)
     return 1;
 }
 
+// Number of pages rewritten and skipped while deploying.  The deployer
+// has no host connection, so these may only be inspected with a debugger.
+uint32_t deployer_pages_written __visible, deployer_pages_skipped __visible;
+
 // Halt the processor
 static void
 halt(void)
@@ -71,33 +76,50 @@ sched_main(void)
     extern void ctr_run_initfuncs(void);
     ctr_run_initfuncs();
 
-    // Check if flash has already been written
-    void *fstart = (void*)CONFIG_FLASH_START;
-    uint32_t cbsize = deployer_canboot_binary_size;
-    if (memcmp(fstart, deployer_canboot_binary, cbsize) == 0) {
-        try_request_canboot();
-        halt();
-    }
+    // Rewrite only the flash pages that differ from the new CanBoot
+    uint32_t addr = CONFIG_FLASH_START;
+    const uint8_t *p = deployer_canboot_binary;
+    const uint8_t *end = &p[deployer_canboot_binary_size];
+    while (p < end) {
+        uint32_t next_page = addr + flash_get_page_size(addr);
+        uint32_t count = next_page - addr;
+        if (p + count > end)
+            count = end - p;
+        if (memcmp((void*)addr, p, count) == 0) {
+            deployer_pages_skipped++;
+            p += count;
+            addr = next_page;
+            continue;
+        }
 
-    // Wait 100ms to help ensure power supply is stable before
-    // overwriting existing bootloader
-    udelay(100000);
+        if (!deployer_pages_written)
+            // Wait 100ms to help ensure power supply is stable before
+            // overwriting existing bootloader
+            udelay(100000);
+        deployer_pages_written++;
 
-    // Write CanBoot to flash
-    const uint8_t *p = deployer_canboot_binary, *end = &p[cbsize];
-    while (p < end) {
-        uint32_t data[CONFIG_BLOCK_SIZE / 4];
-        memset(data, 0xff, sizeof(data));
-        uint32_t c = CONFIG_BLOCK_SIZE;
-        if (p + c > end)
-            c = end - p;
-        memcpy(data, p, c);
-        int ret = flash_write_block((uint32_t)fstart, data);
-        if (ret < 0)
-            // An error occurred - halt to try avoiding endless boot loops
-            halt();
-        p += c;
-        fstart += c;
+        // Write the page (the first block write erases it)
+        const uint8_t *page_end = &p[count];
+        while (p < page_end) {
+            uint32_t data[CONFIG_BLOCK_SIZE / 4];
+            memset(data, 0xff, sizeof(data));
+            uint32_t c = CONFIG_BLOCK_SIZE;
+            if (p + c > page_end)
+                c = page_end - p;
+            memcpy(data, p, c);
+            int ret = flash_write_block(addr, data);
+            if (ret < 0)
+                // An error occurred - halt to try avoiding endless boot loops
+                halt();
+            p += c;
+            addr += c;
+        }
+        addr = next_page;
+    }
+    if (!deployer_pages_written) {
+        // Flash has already been written
+        try_request_canboot();
+        halt();
     }
     flash_complete();
 
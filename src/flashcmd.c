@@ -12,6 +12,7 @@
 #include "canboot.h" // application_jump
 #include "command.h" // command_respond_ack
 #include "flashcmd.h" // flashcmd_is_in_transfer
+#include "generic/canserial.h" // canserial_set_compact
 #include "sched.h" // DECL_TASK
 
 // Handler for "connect" commands
@@ -30,7 +31,28 @@ command_connect(uint32_t *data)
         &out[6 + mcuwords], CONFIG_KATAPULT_VERSION,
         strlen(CONFIG_KATAPULT_VERSION)
     );
+    // The connect response is always sent in the standard format, the
+    // requested response format applies to later commands
+    uint32_t flags = command_get_arg_count(data) ? le32_to_cpu(data[1]) : 0;
+    if (CONFIG_CANSERIAL)
+        canserial_set_compact(0);
     command_respond_ack(CMD_CONNECT, out, ARRAY_SIZE(out));
+    if (CONFIG_CANSERIAL)
+        canserial_set_compact(flags & CONNECT_FLAG_COMPACT);
+}
+
+// Handler for "echo" commands - return the payload unmodified
+void
+command_echo(uint32_t *data)
+{
+    uint32_t count = command_get_arg_count(data);
+    if (count > CONFIG_BLOCK_SIZE / 4 + 1) {
+        command_respond_command_error();
+        return;
+    }
+    uint32_t out[count + 3];
+    memcpy(&out[2], &data[1], count * 4);
+    command_respond_ack(CMD_ECHO, out, ARRAY_SIZE(out));
 }
 
 
@@ -41,20 +63,82 @@ command_connect(uint32_t *data)
 static uint8_t complete;
 static uint32_t complete_endtime;
 
+enum { CS_DRAIN = 1, CS_GUARD };
+
+#define COMPLETE_TIMEOUT_US 100000
+
+// Serial reports idle once the last byte has left the uart, while CAN
+// and USB report idle once the final data is queued in the hardware.
+// Up to four CAN frames (of at most 160 bits with stuffing) may then
+// be waiting for the bus, and the host reads the final USB packet at
+// its next poll of the endpoint (at least once per 1ms frame).
+#define COMPLETE_CAN_QUEUED_BITS (4 * 160)
+#define COMPLETE_USB_GUARD_US 2000
+
+static uint32_t
+complete_guard_us(void)
+{
+    if (CONFIG_CANSERIAL)
+        return DIV_ROUND_UP(COMPLETE_CAN_QUEUED_BITS * 1000000
+                            , CONFIG_CANBUS_FREQUENCY);
+    if (CONFIG_USBSERIAL)
+        return COMPLETE_USB_GUARD_US;
+    return 0;
+}
+
+// Exit once the final response has been sent
+static void
+complete_start(void)
+{
+    complete = CS_DRAIN;
+    complete_endtime = timer_read_time() + timer_from_us(COMPLETE_TIMEOUT_US);
+}
+
 void
 command_complete(uint32_t *data)
 {
+    // The host may keep the previous application, such as when a newly
+    // written bank failed verification
+    if (CONFIG_ENABLE_FLASH_BANK_SWAP && command_get_arg_count(data)
+        && le32_to_cpu(data[1]) & COMPLETE_FLAG_KEEP_BANK)
+        flash_bank_cancel_swap();
     uint32_t out[3];
     command_respond_ack(CMD_COMPLETE, out, ARRAY_SIZE(out));
-    complete = 1;
-    complete_endtime = timer_read_time() + timer_from_us(100000);
+    complete_start();
+}
+
+// Handler for "swap bank" commands - boot the image in the other bank
+void
+command_swap_bank(uint32_t *data)
+{
+    if (!CONFIG_ENABLE_FLASH_BANK_SWAP || flash_bank_request_swap() < 0) {
+        command_respond_command_error();
+        return;
+    }
+    uint32_t out[3];
+    command_respond_ack(CMD_SWAP_BANK, out, ARRAY_SIZE(out));
+    complete_start();
 }
 
 void
 complete_task(void)
 {
-    if (complete && timer_is_before(complete_endtime, timer_read_time()))
+    if (!complete)
+        return;
+    uint32_t curtime = timer_read_time();
+    if (complete == CS_DRAIN && console_tx_idle()) {
+        // Allow the hardware time to transmit the final bytes
+        complete = CS_GUARD;
+        uint32_t endtime = curtime + timer_from_us(complete_guard_us());
+        if (timer_is_before(endtime, complete_endtime))
+            complete_endtime = endtime;
+    }
+    if (timer_is_before(complete_endtime, curtime)) {
+        if (CONFIG_ENABLE_FLASH_BANK_SWAP)
+            // Boot a newly written image by swapping flash banks
+            flash_bank_commit();
         application_jump();
+    }
 }
 DECL_TASK(complete_task);
 
@@ -111,7 +195,64 @@ command_eof(uint32_t *data)
         command_respond_command_error();
         return;
     }
-    uint32_t out[4];
+    uint32_t out[5], out_len = ARRAY_SIZE(out) - 1;
     out[2] = cpu_to_le32(ret);
-    command_respond_ack(CMD_RX_EOF, out, ARRAY_SIZE(out));
+    if (command_get_arg_count(data)) {
+        // The host requested the count of unchanged pages
+        uint32_t skipped = 0;
+        if (CONFIG_ENABLE_FLASH_SKIP_UNCHANGED)
+            skipped = flash_get_skipped_pages();
+        out[3] = cpu_to_le32(skipped);
+        out_len++;
+    }
+    command_respond_ack(CMD_RX_EOF, out, out_len);
+}
+
+
+/****************************************************************
+ * Command "read range" handling
+ ****************************************************************/
+
+#define FLASH_END (CONFIG_FLASH_START + CONFIG_FLASH_SIZE)
+
+static uint32_t range_address, range_end;
+
+// Handler for "read range" commands - stream a range of flash blocks
+void
+command_read_range(uint32_t *data)
+{
+    is_in_transfer = 1;
+    uint32_t address = le32_to_cpu(data[1]), count = le32_to_cpu(data[2]);
+    if (command_get_arg_count(data) != 2 || address % CONFIG_BLOCK_SIZE
+        || address - CONFIG_FLASH_START >= CONFIG_FLASH_SIZE) {
+        command_respond_command_error();
+        return;
+    }
+    // Ranges extending past the end of flash are truncated, the host
+    // learns the end of the stream from the response
+    if (count > FLASH_END - address)
+        count = FLASH_END - address;
+    range_address = address;
+    range_end = address + ALIGN(count, CONFIG_BLOCK_SIZE);
+    uint32_t out[5];
+    out[2] = cpu_to_le32(range_address);
+    out[3] = cpu_to_le32(range_end);
+    command_respond_ack(CMD_READ_RANGE, out, ARRAY_SIZE(out));
+}
+
+// Send the next block of a range whenever the transmit buffer has room
+void
+read_range_task(void)
+{
+    uint32_t address = range_address;
+    if (address >= range_end)
+        return;
+    uint32_t out[CONFIG_BLOCK_SIZE / 4 + 2 + 2];
+    if (console_get_tx_space() < sizeof(out))
+        return;
+    out[2] = cpu_to_le32(address);
+    application_read_flash(address, &out[3]);
+    command_respond_ack(CMD_READ_RANGE, out, ARRAY_SIZE(out));
+    range_address = address + CONFIG_BLOCK_SIZE;
 }
+DECL_TASK(read_range_task);
@@ -9,8 +9,10 @@
 #include "autoconf.h" // CONFIG_MCU
 #include "board/internal.h" // SysTick
 #include "board/irq.h" // irq_disable
+#include "bootentry.h" // board_reset_flags_clear
 #include "canboot.h" // get_bootup_code
 #include "command.h" // DECL_CONSTANT_STR
+#include "misc.h" // dynmem_start
 
 // Export MCU type
 DECL_CONSTANT_STR("MCU", CONFIG_MCU);
@@ -53,6 +55,8 @@ set_bootup_code(uint64_t code)
 void
 application_read_flash(uint32_t address, uint32_t *dest)
 {
+    if (CONFIG_ENABLE_FLASH_BANK_SWAP)
+        address = flash_bank_read_address(address);
     memcpy(dest, (void*)address, CONFIG_BLOCK_SIZE);
 }
 
@@ -111,8 +115,15 @@ void __noreturn __visible __section(".text.armcm_boot.stage_two")
 reset_handler_stage_two(void)
 {
     uint64_t bootup_code = get_bootup_code();
-    if (bootup_code == REQUEST_START_APP)
+    if (bootup_code == REQUEST_START_APP) {
+        if (CONFIG_ENABLE_DOUBLE_RESET && CONFIG_HAVE_BOARD_RESET_FLAGS)
+            board_reset_flags_clear();
+        if (CONFIG_ENABLE_BOOT_TIMESTAMPS)
+            boot_timestamp_record(BOOT_PHASE_APP);
         boot_start_application();
+    }
+    if (CONFIG_ENABLE_BOOT_TIMESTAMPS)
+        boot_timestamps_start();
 
     // Copy global variables from flash to ram
     uint32_t count = (&_data_end - &_data_start) * 4;
@@ -134,9 +145,14 @@ reset_handler_stage_two(void)
         ;
 }
 
-// Initial code entry point - invoked by the processor after a reset
+// Initial code entry point - invoked by the processor after a reset.
+// It is preceded by a struct canboot_image_info.
 asm(".section .text.armcm_boot.stage_one\n"
     ".balign 8\n"
+    "1:\n"
+    ".asciz \"" CONFIG_MCU "\"\n"
+    ".space 28 - (. - 1b)\n"
+    ".4byte " __stringify(CONFIG_FLASH_START) "\n"
     ".8byte " __stringify(CANBOOT_SIGNATURE) "\n"
     ".global ResetHandler\n"
     ".type ResetHandler, %function\n"
@@ -153,3 +169,22 @@ DefaultHandler(void)
     for (;;)
         ;
 }
+
+
+/****************************************************************
+ * Dynamic memory range
+ ****************************************************************/
+
+// Return the start of memory available for dynamic allocations
+void *
+dynmem_start(void)
+{
+    return &_bss_end;
+}
+
+// Return the end of memory available for dynamic allocations
+void *
+dynmem_end(void)
+{
+    return &_stack_start;
+}
@@ -7,6 +7,7 @@
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
 #include <string.h> // memcpy
+#include "autoconf.h" // CONFIG_CANBUS_ISOTP
 #include "board/io.h" // readb
 #include "board/irq.h" // irq_save
 #include "board/misc.h" // console_sendf
@@ -25,15 +26,25 @@ static struct canbus_data {
 
     // Tx data
     struct task_wake tx_wake;
-    uint8_t transmit_pos, transmit_max;
+    uint8_t transmit_pos, transmit_max, transmit_msg_left, compact;
 
     // Rx data
     struct task_wake rx_wake;
     uint8_t receive_pos;
     uint32_t admin_pull_pos, admin_push_pos;
 
+    // Admin state
+    uint8_t query_pending;
+    uint32_t query_time;
+
+    // ISO-TP state
+    uint16_t rx_remaining, tx_remaining;
+    uint8_t isotp, rx_seq, rx_block_left, fc_pending;
+    uint8_t tx_seq, tx_block_size, tx_block_left, tx_wait_fc;
+    uint32_t tx_stmin, tx_time;
+
     // Transfer buffers
-    struct canbus_msg admin_queue[8];
+    struct canbus_msg admin_queue[16];
     uint8_t transmit_buf[96];
     uint8_t receive_buf[192];
 } CanData;
@@ -49,34 +60,70 @@ canserial_notify_tx(void)
     sched_wake_task(&CanData.tx_wake);
 }
 
+// Handlers defined below
+static void can_send_query_response(void);
+static void isotp_tx_task(uint32_t id);
+static int isotp_check_framing(struct canbus_msg *msg);
+static int isotp_process_data(struct canbus_msg *msg);
+
 void
 canserial_tx_task(void)
 {
     if (!sched_check_wake(&CanData.tx_wake))
         return;
+    if (CanData.query_pending)
+        can_send_query_response();
     uint32_t id = CanData.assigned_id;
     if (!id) {
         CanData.transmit_pos = CanData.transmit_max = 0;
+        CanData.transmit_msg_left = 0;
+        return;
+    }
+    if (CONFIG_CANBUS_ISOTP && CanData.isotp) {
+        isotp_tx_task(id);
         return;
     }
     struct canbus_msg msg;
     msg.id = id + 1;
     uint32_t tpos = CanData.transmit_pos, tmax = CanData.transmit_max;
+    uint32_t msg_left = CanData.transmit_msg_left;
     for (;;) {
-        int avail = tmax - tpos, now = avail > 8 ? 8 : avail;
-        if (avail <= 0)
+        if (tpos >= tmax)
             break;
+        // Each response starts in a new frame
+        if (!msg_left)
+            msg_left = command_response_size(&CanData.transmit_buf[tpos]);
+        int now = msg_left > 8 ? 8 : msg_left;
         msg.dlc = now;
         memcpy(msg.data, &CanData.transmit_buf[tpos], now);
         int ret = canbus_send(&msg);
         if (ret <= 0)
             break;
         tpos += now;
+        msg_left -= now;
     }
     CanData.transmit_pos = tpos;
+    CanData.transmit_msg_left = msg_left;
 }
 DECL_TASK(canserial_tx_task);
 
+// Return the number of bytes available for new response messages
+uint32_t
+console_get_tx_space(void)
+{
+    uint32_t tpos = CanData.transmit_pos, tmax = CanData.transmit_max;
+    if (tpos >= tmax)
+        return sizeof(CanData.transmit_buf);
+    return sizeof(CanData.transmit_buf) - (tmax - tpos);
+}
+
+// Check if all response messages have been handed to the hardware
+int
+console_tx_idle(void)
+{
+    return CanData.transmit_pos >= CanData.transmit_max;
+}
+
 // Encode and transmit a "response" message
 void
 console_sendf(const struct command_encoder *ce, va_list args)
@@ -98,8 +145,12 @@ console_sendf(const struct command_encoder *ce, va_list args)
     }
 
     // Generate message
-    uint32_t msglen = command_encode_and_frame(&CanData.transmit_buf[tmax]
-                                               , ce, args);
+    uint8_t *buf = &CanData.transmit_buf[tmax];
+    uint32_t msglen;
+    if (CanData.compact)
+        msglen = command_encode_compact(buf, ce);
+    else
+        msglen = command_encode_and_frame(buf, ce, args);
 
     // Start message transmit
     CanData.transmit_max = tmax + msglen;
@@ -140,29 +191,53 @@ can_decode_nodeid(int nodeid)
     return (nodeid << 1) + 0x100;
 }
 
+// Unassigned nodes all answer the same query.  Each node delays its
+// response by a slot derived from its uuid so the responses don't
+// collide on the bus.
+#define QUERY_SLOT_COUNT 32
+#define QUERY_SLOT_TIME 250
+
 static void
 can_process_query_unassigned(struct canbus_msg *msg)
 {
     if (CanData.assigned_id)
         return;
+    uint32_t slot = CanData.uuid[0] % QUERY_SLOT_COUNT;
+    CanData.query_time = timer_read_time() + timer_from_us(
+        slot * QUERY_SLOT_TIME);
+    CanData.query_pending = 1;
+    canserial_notify_tx();
+}
+
+// Send a pending query response once its slot is reached
+static void
+can_send_query_response(void)
+{
+    if (CanData.assigned_id) {
+        CanData.query_pending = 0;
+        return;
+    }
+    if (timer_is_before(timer_read_time(), CanData.query_time)) {
+        canserial_notify_tx();
+        return;
+    }
     struct canbus_msg send;
     send.id = CANBUS_ID_ADMIN_RESP;
     send.dlc = 8;
     send.data[0] = CANBUS_RESP_NEED_NODEID;
     memcpy(&send.data[1], CanData.uuid, sizeof(CanData.uuid));
     send.data[7] = CANBUS_CMD_SET_CANBOOT_NODEID;
-    // Send with retry
-    for (;;) {
-        int ret = canbus_send(&send);
-        if (ret >= 0)
-            return;
-    }
+    // The transmit interrupt wakes the task to retry a full queue
+    if (canbus_send(&send) < 0)
+        return;
+    CanData.query_pending = 0;
 }
 
 static void
 can_process_clear_canboot_nodeid(void)
 {
     CanData.assigned_id = 0;
+    CanData.compact = 0;
     canbus_set_filter(CanData.assigned_id);
 }
 
@@ -182,6 +257,7 @@ can_process_set_canboot_nodeid(struct canbus_msg *msg)
     if (can_check_uuid(msg)) {
         if (newid != CanData.assigned_id) {
             CanData.assigned_id = newid;
+            CanData.compact = 0;
             canbus_set_filter(CanData.assigned_id);
         }
     } else if (newid == CanData.assigned_id) {
@@ -226,7 +302,10 @@ int
 canserial_process_data(struct canbus_msg *msg)
 {
     uint32_t id = msg->id;
-    if (CanData.assigned_id && id == CanData.assigned_id) {
+    if (CONFIG_CANBUS_ISOTP && CanData.assigned_id
+        && id == CanData.assigned_id && isotp_check_framing(msg)) {
+        return isotp_process_data(msg);
+    } else if (CanData.assigned_id && id == CanData.assigned_id) {
         // Add to incoming data buffer
         int rpos = CanData.receive_pos;
         uint32_t len = CANMSG_DATA_LEN(msg);
@@ -274,6 +353,9 @@ console_pop_input(int len)
         irq_restore(flag);
         break;
     }
+    if (CONFIG_CANBUS_ISOTP && CanData.fc_pending)
+        // Flow control may be waiting on space in the receive buffer
+        canserial_notify_tx();
 }
 
 // Task to process incoming commands and admin messages
@@ -313,6 +395,234 @@ canserial_rx_task(void)
 DECL_TASK(canserial_rx_task);
 
 
+/****************************************************************
+ * ISO-TP (ISO 15765-2) framing
+ ****************************************************************/
+
+#define ISOTP_SINGLE 0x00
+#define ISOTP_FIRST 0x10
+#define ISOTP_CONSECUTIVE 0x20
+#define ISOTP_FLOW_CONTROL 0x30
+#define ISOTP_FC_CTS 0x00
+#define ISOTP_FC_WAIT 0x01
+#define ISOTP_MAX_LEN 4095
+#define ISOTP_FC_TIMEOUT 1000000
+
+// Hosts without ISO-TP support send each command as plain frames, so
+// check the framing of the first frame of every command.  A plain
+// command starts with the message header, while an ISO-TP command
+// (at least MESSAGE_MIN bytes long) starts with a First Frame.
+// Responses are sent using the framing of the last command.
+static int
+isotp_check_framing(struct canbus_msg *msg)
+{
+    if (CanData.receive_pos || CanData.rx_remaining || CANMSG_DATA_LEN(msg) < 2)
+        // In the middle of a command
+        return CanData.isotp;
+    uint8_t pci = msg->data[0];
+    if (pci == MESSAGE_STX1 && msg->data[1] == MESSAGE_STX2) {
+        if (CanData.isotp) {
+            CanData.isotp = 0;
+            CanData.tx_remaining = CanData.tx_wait_fc = 0;
+        }
+    } else if ((pci & 0xf0) == ISOTP_FIRST && !CanData.isotp) {
+        CanData.isotp = 1;
+        CanData.transmit_msg_left = 0;
+    }
+    return CanData.isotp;
+}
+
+// Convert a flow control separation time to timer ticks
+static uint32_t
+isotp_stmin_ticks(uint8_t stmin)
+{
+    if (stmin <= 0x7f)
+        return timer_from_us(stmin * 1000);
+    if (stmin >= 0xf1 && stmin <= 0xf9)
+        return timer_from_us((stmin - 0xf0) * 100);
+    return timer_from_us(127000);
+}
+
+// Append received payload data to the incoming data buffer
+static int
+isotp_rx_append(uint8_t *data, uint32_t len)
+{
+    int rpos = CanData.receive_pos;
+    if (len > sizeof(CanData.receive_buf) - rpos)
+        return -1;
+    memcpy(&CanData.receive_buf[rpos], data, len);
+    CanData.receive_pos = rpos + len;
+    canserial_notify_rx();
+    return 0;
+}
+
+// Handle an ISO-TP frame from the host (called from IRQ handler)
+static int
+isotp_process_data(struct canbus_msg *msg)
+{
+    uint32_t dlc = CANMSG_DATA_LEN(msg), len;
+    if (!dlc)
+        return -1;
+    uint8_t pci = msg->data[0];
+    switch (pci & 0xf0) {
+    case ISOTP_SINGLE:
+        CanData.rx_remaining = 0;
+        len = pci & 0x0f;
+        if (!len || len > dlc - 1)
+            return -1;
+        return isotp_rx_append(&msg->data[1], len);
+    case ISOTP_FIRST:
+        CanData.rx_remaining = 0;
+        len = ((pci & 0x0f) << 8) | msg->data[1];
+        if (dlc < 8 || len < 8 || isotp_rx_append(&msg->data[2], 6))
+            return -1;
+        CanData.rx_remaining = len - 6;
+        CanData.rx_seq = 1;
+        CanData.fc_pending = 1;
+        canserial_notify_tx();
+        return 0;
+    case ISOTP_CONSECUTIVE:
+        if (!CanData.rx_remaining || (pci & 0x0f) != CanData.rx_seq)
+            goto abort;
+        len = CanData.rx_remaining > 7 ? 7 : CanData.rx_remaining;
+        if (len > dlc - 1 || isotp_rx_append(&msg->data[1], len))
+            goto abort;
+        CanData.rx_remaining -= len;
+        CanData.rx_seq = (CanData.rx_seq + 1) & 0x0f;
+        if (CanData.rx_remaining && CanData.rx_block_left
+            && !--CanData.rx_block_left) {
+            CanData.fc_pending = 1;
+            canserial_notify_tx();
+        }
+        return 0;
+    case ISOTP_FLOW_CONTROL:
+        if (dlc < 3 || !CanData.tx_wait_fc)
+            return 0;
+        if ((pci & 0x0f) == ISOTP_FC_CTS) {
+            CanData.tx_block_size = CanData.tx_block_left = msg->data[1];
+            CanData.tx_stmin = isotp_stmin_ticks(msg->data[2]);
+            CanData.tx_wait_fc = 0;
+        } else if ((pci & 0x0f) == ISOTP_FC_WAIT) {
+            CanData.tx_time = timer_read_time() + timer_from_us(
+                ISOTP_FC_TIMEOUT);
+            return 0;
+        } else {
+            // Overflow - abort the message at the next transmit
+            CanData.tx_time = timer_read_time();
+        }
+        canserial_notify_tx();
+        return 0;
+    }
+    return -1;
+abort:
+    CanData.rx_remaining = 0;
+    return -1;
+}
+
+// Send a flow control frame once there is room for the next block
+static int
+isotp_send_fc(struct canbus_msg *msg)
+{
+    uint32_t avail = sizeof(CanData.receive_buf) - readb(&CanData.receive_pos);
+    uint32_t bs = avail / 7;
+    if (!bs)
+        // Wait for the receive buffer to drain
+        return 0;
+    if (CanData.rx_remaining <= avail)
+        bs = 0;
+    else if (bs > 255)
+        bs = 255;
+    msg->dlc = 3;
+    msg->data[0] = ISOTP_FLOW_CONTROL | ISOTP_FC_CTS;
+    msg->data[1] = bs;
+    msg->data[2] = 0;
+    CanData.rx_block_left = bs;
+    int ret = canbus_send(msg);
+    if (ret <= 0)
+        return -1;
+    CanData.fc_pending = 0;
+    return 0;
+}
+
+// Transmit pending data as ISO-TP messages
+static void
+isotp_tx_task(uint32_t id)
+{
+    struct canbus_msg msg;
+    msg.id = id + 1;
+    if (CanData.fc_pending && isotp_send_fc(&msg))
+        return;
+    uint32_t tpos = CanData.transmit_pos, tmax = CanData.transmit_max;
+    for (;;) {
+        uint32_t remaining = CanData.tx_remaining, now;
+        if (!remaining) {
+            // Start a new message
+            uint32_t avail = tmax - tpos;
+            if (!avail)
+                break;
+            if (avail <= 7) {
+                msg.dlc = avail + 1;
+                msg.data[0] = ISOTP_SINGLE | avail;
+                memcpy(&msg.data[1], &CanData.transmit_buf[tpos], avail);
+                if (canbus_send(&msg) <= 0)
+                    break;
+                tpos += avail;
+                continue;
+            }
+            if (avail > ISOTP_MAX_LEN)
+                avail = ISOTP_MAX_LEN;
+            msg.dlc = 8;
+            msg.data[0] = ISOTP_FIRST | (avail >> 8);
+            msg.data[1] = avail;
+            memcpy(&msg.data[2], &CanData.transmit_buf[tpos], 6);
+            if (canbus_send(&msg) <= 0)
+                break;
+            tpos += 6;
+            CanData.tx_remaining = avail - 6;
+            CanData.tx_seq = 1;
+            CanData.tx_time = timer_read_time() + timer_from_us(
+                ISOTP_FC_TIMEOUT);
+            CanData.tx_wait_fc = 1;
+            continue;
+        }
+        now = timer_read_time();
+        if (CanData.tx_wait_fc) {
+            if (timer_is_before(now, CanData.tx_time)) {
+                // Poll until flow control arrives or the timeout expires
+                canserial_notify_tx();
+                break;
+            }
+            // No flow control from host - discard the message
+            tpos += remaining;
+            CanData.tx_remaining = 0;
+            CanData.tx_wait_fc = 0;
+            continue;
+        }
+        if (CanData.tx_stmin && timer_is_before(now, CanData.tx_time)) {
+            // Wait for the separation time requested by the host
+            canserial_notify_tx();
+            break;
+        }
+        uint32_t len = remaining > 7 ? 7 : remaining;
+        msg.dlc = len + 1;
+        msg.data[0] = ISOTP_CONSECUTIVE | CanData.tx_seq;
+        memcpy(&msg.data[1], &CanData.transmit_buf[tpos], len);
+        if (canbus_send(&msg) <= 0)
+            break;
+        tpos += len;
+        CanData.tx_remaining = remaining - len;
+        CanData.tx_seq = (CanData.tx_seq + 1) & 0x0f;
+        CanData.tx_time = now + CanData.tx_stmin;
+        if (CanData.tx_remaining && CanData.tx_block_size
+            && !--CanData.tx_block_left) {
+            CanData.tx_time = now + timer_from_us(ISOTP_FC_TIMEOUT);
+            CanData.tx_wait_fc = 1;
+        }
+    }
+    CanData.transmit_pos = tpos;
+}
+
+
 /****************************************************************
  * Setup and shutdown
  ****************************************************************/
@@ -325,6 +635,13 @@ command_get_canbus_id(uint32_t *args)
     command_respond_ack(CMD_GET_CANBUS_ID, out, ARRAY_SIZE(out));
 }
 
+// Select the response format requested in a "connect" command
+void
+canserial_set_compact(int compact)
+{
+    CanData.compact = compact;
+}
+
 void
 canserial_set_uuid(uint8_t *raw_uuid, uint32_t raw_uuid_len)
 {
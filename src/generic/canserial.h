@@ -10,6 +10,7 @@
 void canserial_notify_tx(void);
 struct canbus_msg;
 int canserial_process_data(struct canbus_msg *msg);
+void canserial_set_compact(int compact);
 void canserial_set_uuid(uint8_t *raw_uuid, uint32_t raw_uuid_len);
 
 #endif // canserial.h
@@ -6,11 +6,10 @@
 
 #include "misc.h" // crc16_ccitt
 
-// Implement the standard crc "ccitt" algorithm on the given buffer
+// Continue a crc "ccitt" calculation over the given buffer
 uint16_t
-crc16_ccitt(uint8_t *buf, uint_fast8_t len)
+crc16_ccitt_update(uint16_t crc, uint8_t *buf, uint32_t len)
 {
-    uint16_t crc = 0xffff;
     while (len--) {
         uint8_t data = *buf++;
         data ^= crc & 0xff;
@@ -20,3 +19,10 @@ crc16_ccitt(uint8_t *buf, uint_fast8_t len)
     }
     return crc;
 }
+
+// Implement the standard crc "ccitt" algorithm on the given buffer
+uint16_t
+crc16_ccitt(uint8_t *buf, uint_fast8_t len)
+{
+    return crc16_ccitt_update(0xffff, buf, len);
+}
@@ -6,6 +6,8 @@
 
 struct command_encoder;
 void console_sendf(const struct command_encoder *ce, va_list args);
+uint32_t console_get_tx_space(void);
+int console_tx_idle(void);
 void *console_receive_buffer(void);
 
 uint32_t timer_from_us(uint32_t us);
@@ -16,6 +18,7 @@ void timer_kick(void);
 void *dynmem_start(void);
 void *dynmem_end(void);
 
+uint16_t crc16_ccitt_update(uint16_t crc, uint8_t *buf, uint32_t len);
 uint16_t crc16_ccitt(uint8_t *buf, uint_fast8_t len);
 
 void bootloader_request(void);
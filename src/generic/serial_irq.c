@@ -10,6 +10,7 @@
 #include "board/irq.h" // irq_save
 #include "board/misc.h" // console_sendf
 #include "board/pgm.h" // READP
+#include "byteorder.h" // le32_to_cpu
 #include "command.h" // DECL_CONSTANT
 #include "sched.h" // sched_wake_tasks
 #include "serial_irq.h" // serial_enable_tx_irq
@@ -70,14 +71,79 @@ console_pop_input(uint_fast8_t len)
     }
 }
 
+
+/****************************************************************
+ * Baud rate change
+ ****************************************************************/
+
+// Time to wait for a valid command at a new baud rate before reverting
+#define BAUD_CONFIRM_TIME 1000000
+
+enum { BS_PENDING=1, BS_CONFIRM=2 };
+
+static uint8_t baud_state;
+static uint32_t baud_new, baud_confirm_endtime;
+
+// Handler for "set baud" commands
+void
+command_set_baud(uint32_t *data)
+{
+    if (command_get_arg_count(data) != 1)
+        goto fail;
+    uint32_t baud = le32_to_cpu(data[1]);
+    if (!baud)
+        goto fail;
+    // Reject rates that can't be generated within 2%
+    uint32_t actual = serial_calc_baud(baud);
+    uint32_t err = actual > baud ? actual - baud : baud - actual;
+    if (!actual || err > baud / 50)
+        goto fail;
+    uint32_t out[4];
+    out[2] = cpu_to_le32(actual);
+    command_respond_ack(CMD_SET_BAUD, out, ARRAY_SIZE(out));
+    baud_new = baud;
+    baud_state = BS_PENDING;
+    return;
+fail:
+    command_respond_command_error();
+}
+
+// Switch baud after the response is sent and revert if unconfirmed
+static void
+baud_check(void)
+{
+    if (baud_state == BS_PENDING) {
+        if (readb(&transmit_pos) < readb(&transmit_max))
+            return;
+        serial_set_baud(baud_new);
+        baud_state = BS_CONFIRM;
+        baud_confirm_endtime = timer_read_time()
+            + timer_from_us(BAUD_CONFIRM_TIME);
+    } else if (timer_is_before(baud_confirm_endtime, timer_read_time())) {
+        serial_set_baud(CONFIG_SERIAL_BAUD);
+        baud_state = 0;
+    }
+}
+
+
+/****************************************************************
+ * Console
+ ****************************************************************/
+
 // Process any incoming commands
 void
 console_task(void)
 {
+    if (CONFIG_SERIAL_BAUD_CHANGE && baud_state)
+        baud_check();
     uint_fast8_t rpos = readb(&receive_pos), pop_count;
     int_fast8_t ret = command_find_block(receive_buf, rpos, &pop_count);
-    if (ret > 0)
+    if (ret > 0) {
+        if (CONFIG_SERIAL_BAUD_CHANGE && baud_state == BS_CONFIRM)
+            // Valid command received at the new rate
+            baud_state = 0;
         command_dispatch(receive_buf, pop_count);
+    }
     if (ret) {
         console_pop_input(pop_count);
         if (ret > 0)
@@ -86,6 +152,23 @@ console_task(void)
 }
 DECL_TASK(console_task);
 
+// Return the number of bytes available for new response messages
+uint32_t
+console_get_tx_space(void)
+{
+    uint_fast8_t tpos = readb(&transmit_pos), tmax = readb(&transmit_max);
+    if (tpos >= tmax)
+        return sizeof(transmit_buf);
+    return sizeof(transmit_buf) - (tmax - tpos);
+}
+
+// Check if all response messages have been transmitted
+int
+console_tx_idle(void)
+{
+    return readb(&transmit_pos) >= readb(&transmit_max) && serial_tx_done();
+}
+
 // Encode and transmit a "response" message
 void
 console_sendf(const struct command_encoder *ce, va_list args)
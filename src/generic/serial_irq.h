@@ -5,6 +5,9 @@
 
 // callback provided by board specific code
 void serial_enable_tx_irq(void);
+uint32_t serial_calc_baud(uint32_t baud);
+void serial_set_baud(uint32_t baud);
+int serial_tx_done(void);
 
 // serial_irq.c
 void serial_rx_byte(uint_fast8_t data);
@@ -44,23 +44,41 @@ usb_bulk_in_task(void)
 {
     if (!sched_check_wake(&usb_bulk_in_wake))
         return;
-    uint_fast8_t tpos = transmit_pos;
-    if (!tpos)
-        return;
-    uint_fast8_t max_tpos = (tpos > USB_CDC_EP_BULK_IN_SIZE
-                             ? USB_CDC_EP_BULK_IN_SIZE : tpos);
-    int_fast8_t ret = usb_send_bulk_in(transmit_buf, max_tpos);
-    if (ret <= 0)
+    uint_fast8_t tpos = transmit_pos, sent = 0;
+    // Queue as many packets as the hardware has buffers available
+    while (sent < tpos) {
+        uint_fast8_t max_tpos = (tpos - sent > USB_CDC_EP_BULK_IN_SIZE
+                                 ? USB_CDC_EP_BULK_IN_SIZE : tpos - sent);
+        int_fast8_t ret = usb_send_bulk_in(&transmit_buf[sent], max_tpos);
+        if (ret <= 0)
+            break;
+        sent += ret;
+    }
+    if (!sent)
         return;
-    uint_fast8_t needcopy = tpos - ret;
+    uint_fast8_t needcopy = tpos - sent;
     if (needcopy) {
-        memmove(transmit_buf, &transmit_buf[ret], needcopy);
+        memmove(transmit_buf, &transmit_buf[sent], needcopy);
         usb_notify_bulk_in();
     }
     transmit_pos = needcopy;
 }
 DECL_TASK(usb_bulk_in_task);
 
+// Return the number of bytes available for new response messages
+uint32_t
+console_get_tx_space(void)
+{
+    return sizeof(transmit_buf) - transmit_pos;
+}
+
+// Check if all response messages have been handed to the hardware
+int
+console_tx_idle(void)
+{
+    return !transmit_pos;
+}
+
 // Encode and transmit a "response" message
 void
 console_sendf(const struct command_encoder *ce, va_list args)
@@ -131,52 +149,6 @@ DECL_TASK(usb_bulk_out_task);
  * USB descriptors
  ****************************************************************/
 
-#define CONCAT1(a, b) a ## b
-#define CONCAT(a, b) CONCAT1(a, b)
-#define USB_STR_MANUFACTURER u"katapult"
-#define USB_STR_PRODUCT CONCAT(u,CONFIG_MCU)
-#define USB_STR_SERIAL CONCAT(u,CONFIG_USB_SERIAL_NUMBER)
-
-// String descriptors
-enum {
-    USB_STR_ID_MANUFACTURER = 1, USB_STR_ID_PRODUCT, USB_STR_ID_SERIAL,
-};
-
-#define SIZE_cdc_string_langids (sizeof(cdc_string_langids) + 2)
-
-static const struct usb_string_descriptor cdc_string_langids PROGMEM = {
-    .bLength = SIZE_cdc_string_langids,
-    .bDescriptorType = USB_DT_STRING,
-    .data = { cpu_to_le16(USB_LANGID_ENGLISH_US) },
-};
-
-#define SIZE_cdc_string_manufacturer \
-    (sizeof(cdc_string_manufacturer) + sizeof(USB_STR_MANUFACTURER) - 2)
-
-static const struct usb_string_descriptor cdc_string_manufacturer PROGMEM = {
-    .bLength = SIZE_cdc_string_manufacturer,
-    .bDescriptorType = USB_DT_STRING,
-    .data = USB_STR_MANUFACTURER,
-};
-
-#define SIZE_cdc_string_product \
-    (sizeof(cdc_string_product) + sizeof(USB_STR_PRODUCT) - 2)
-
-static const struct usb_string_descriptor cdc_string_product PROGMEM = {
-    .bLength = SIZE_cdc_string_product,
-    .bDescriptorType = USB_DT_STRING,
-    .data = USB_STR_PRODUCT,
-};
-
-#define SIZE_cdc_string_serial \
-    (sizeof(cdc_string_serial) + sizeof(USB_STR_SERIAL) - 2)
-
-static const struct usb_string_descriptor cdc_string_serial PROGMEM = {
-    .bLength = SIZE_cdc_string_serial,
-    .bDescriptorType = USB_DT_STRING,
-    .data = USB_STR_SERIAL,
-};
-
 // Device descriptor
 static const struct usb_device_descriptor cdc_device_descriptor PROGMEM = {
     .bLength = sizeof(cdc_device_descriptor),
@@ -273,171 +245,26 @@ static const struct config_s {
     },
 };
 
-// List of available descriptors
-static const struct descriptor_s {
-    uint_fast16_t wValue;
-    uint_fast16_t wIndex;
-    const void *desc;
-    uint_fast8_t size;
-} cdc_descriptors[] PROGMEM = {
+// Class specific descriptors
+const struct usb_descriptor_s usb_class_descriptors[] PROGMEM = {
     { USB_DT_DEVICE<<8, 0x0000,
       &cdc_device_descriptor, sizeof(cdc_device_descriptor) },
     { USB_DT_CONFIG<<8, 0x0000,
       &cdc_config_descriptor, sizeof(cdc_config_descriptor) },
-    { USB_DT_STRING<<8, 0x0000,
-      &cdc_string_langids, SIZE_cdc_string_langids },
-    { (USB_DT_STRING<<8) | USB_STR_ID_MANUFACTURER, USB_LANGID_ENGLISH_US,
-      &cdc_string_manufacturer, SIZE_cdc_string_manufacturer },
-    { (USB_DT_STRING<<8) | USB_STR_ID_PRODUCT, USB_LANGID_ENGLISH_US,
-      &cdc_string_product, SIZE_cdc_string_product },
-#if !CONFIG_USB_SERIAL_NUMBER_CHIPID
-    { (USB_DT_STRING<<8) | USB_STR_ID_SERIAL, USB_LANGID_ENGLISH_US,
-      &cdc_string_serial, SIZE_cdc_string_serial },
-#endif
 };
 
-// Fill in a USB serial string descriptor from a chip id
-void
-usb_fill_serial(struct usb_string_descriptor *desc, int strlen, void *id)
-{
-    desc->bLength = sizeof(*desc) + strlen * sizeof(desc->data[0]);
-    desc->bDescriptorType = USB_DT_STRING;
-
-    uint8_t *src = id;
-    int i;
-    for (i = 0; i < strlen; i++) {
-        uint8_t c = i & 1 ? src[i/2] & 0x0f : src[i/2] >> 4;
-        desc->data[i] = c < 10 ? c + '0' : c - 10 + 'A';
-    }
-}
+const uint8_t usb_class_descriptor_count = ARRAY_SIZE(usb_class_descriptors);
 
 
 /****************************************************************
- * USB endpoint 0 control message handling
+ * USB class specific control requests
  ****************************************************************/
 
-// State tracking
-enum {
-    UX_READ = 1<<0, UX_SEND = 1<<1, UX_SEND_PROGMEM = 1<<2, UX_SEND_ZLP = 1<<3
-};
-
-static void *usb_xfer_data;
-static uint8_t usb_xfer_size, usb_xfer_flags;
-
-// Set the USB "stall" condition
-static void
-usb_do_stall(void)
-{
-    usb_stall_ep0();
-    usb_xfer_flags = 0;
-}
-
-// Transfer data on the usb endpoint 0
-static void
-usb_do_xfer(void *data, uint_fast8_t size, uint_fast8_t flags)
-{
-    for (;;) {
-        uint_fast8_t xs = size;
-        if (xs > USB_CDC_EP0_SIZE)
-            xs = USB_CDC_EP0_SIZE;
-        int_fast8_t ret;
-        if (flags & UX_READ)
-            ret = usb_read_ep0(data, xs);
-        else if (NEED_PROGMEM && flags & UX_SEND_PROGMEM)
-            ret = usb_send_ep0_progmem(data, xs);
-        else
-            ret = usb_send_ep0(data, xs);
-        if (ret == xs) {
-            // Success
-            data += xs;
-            size -= xs;
-            if (!size) {
-                // Entire transfer completed successfully
-                if (flags & UX_READ) {
-                    // Send status packet at end of read
-                    flags = UX_SEND;
-                    continue;
-                }
-                if (xs == USB_CDC_EP0_SIZE && flags & UX_SEND_ZLP)
-                    // Must send zero-length-packet
-                    continue;
-                usb_xfer_flags = 0;
-                usb_notify_ep0();
-                return;
-            }
-            continue;
-        }
-        if (ret == -1) {
-            // Interface busy - retry later
-            usb_xfer_data = data;
-            usb_xfer_size = size;
-            usb_xfer_flags = flags;
-            return;
-        }
-        // Error
-        usb_do_stall();
-        return;
-    }
-}
-
-static void
-usb_req_get_descriptor(struct usb_ctrlrequest *req)
-{
-    if (req->bRequestType != USB_DIR_IN)
-        goto fail;
-    void *desc = NULL;
-    uint_fast8_t flags, size, i;
-    for (i=0; i<ARRAY_SIZE(cdc_descriptors); i++) {
-        const struct descriptor_s *d = &cdc_descriptors[i];
-        if (READP(d->wValue) == req->wValue
-            && READP(d->wIndex) == req->wIndex) {
-            flags = NEED_PROGMEM ? UX_SEND_PROGMEM : UX_SEND;
-            size = READP(d->size);
-            desc = (void*)READP(d->desc);
-        }
-    }
-    if (CONFIG_USB_SERIAL_NUMBER_CHIPID
-        && req->wValue == ((USB_DT_STRING<<8) | USB_STR_ID_SERIAL)
-        && req->wIndex == USB_LANGID_ENGLISH_US) {
-            struct usb_string_descriptor *usbserial_serialid;
-            usbserial_serialid = usbserial_get_serialid();
-            flags = UX_SEND;
-            size = usbserial_serialid->bLength;
-            desc = (void*)usbserial_serialid;
-    }
-    if (desc) {
-        if (size > req->wLength)
-            size = req->wLength;
-        else if (size < req->wLength)
-            flags |= UX_SEND_ZLP;
-        usb_do_xfer(desc, size, flags);
-        return;
-    }
-fail:
-    usb_do_stall();
-}
-
-static void
-usb_req_set_address(struct usb_ctrlrequest *req)
-{
-    if (req->bRequestType || req->wIndex || req->wLength) {
-        usb_do_stall();
-        return;
-    }
-    usb_set_address(req->wValue);
-}
-
-static void
-usb_req_set_configuration(struct usb_ctrlrequest *req)
+void
+usb_class_configure(void)
 {
-    if (req->bRequestType || req->wValue != 1 || req->wIndex || req->wLength) {
-        usb_do_stall();
-        return;
-    }
-    usb_set_configure();
     usb_notify_bulk_in();
     usb_notify_bulk_out();
-    usb_do_xfer(NULL, 0, UX_SEND);
 }
 
 static struct usb_cdc_line_coding line_coding;
@@ -483,50 +310,13 @@ usb_req_set_line(struct usb_ctrlrequest *req)
     check_reboot();
 }
 
-static void
-usb_state_ready(void)
+void
+usb_class_request(struct usb_ctrlrequest *req)
 {
-    struct usb_ctrlrequest req;
-    int_fast8_t ret = usb_read_ep0_setup(&req, sizeof(req));
-    if (ret != sizeof(req))
-        return;
-    switch (req.bRequest) {
-    case USB_REQ_GET_DESCRIPTOR: usb_req_get_descriptor(&req); break;
-    case USB_REQ_SET_ADDRESS: usb_req_set_address(&req); break;
-    case USB_REQ_SET_CONFIGURATION: usb_req_set_configuration(&req); break;
-    case USB_CDC_REQ_SET_LINE_CODING: usb_req_set_line_coding(&req); break;
-    case USB_CDC_REQ_GET_LINE_CODING: usb_req_get_line_coding(&req); break;
-    case USB_CDC_REQ_SET_CONTROL_LINE_STATE: usb_req_set_line(&req); break;
+    switch (req->bRequest) {
+    case USB_CDC_REQ_SET_LINE_CODING: usb_req_set_line_coding(req); break;
+    case USB_CDC_REQ_GET_LINE_CODING: usb_req_get_line_coding(req); break;
+    case USB_CDC_REQ_SET_CONTROL_LINE_STATE: usb_req_set_line(req); break;
     default: usb_do_stall(); break;
     }
 }
-
-// State tracking dispatch
-static struct task_wake usb_ep0_wake;
-
-void
-usb_notify_ep0(void)
-{
-    sched_wake_task(&usb_ep0_wake);
-}
-
-void
-usb_ep0_task(void)
-{
-    if (!sched_check_wake(&usb_ep0_wake))
-        return;
-    if (usb_xfer_flags)
-        usb_do_xfer(usb_xfer_data, usb_xfer_size, usb_xfer_flags);
-    else
-        usb_state_ready();
-}
-DECL_TASK(usb_ep0_task);
-
-void
-usb_shutdown(void)
-{
-    usb_notify_bulk_in();
-    usb_notify_bulk_out();
-    usb_notify_ep0();
-}
-DECL_SHUTDOWN(usb_shutdown);
@@ -21,12 +21,40 @@ int_fast8_t usb_send_ep0_progmem(const void *data, uint_fast8_t len);
 void usb_stall_ep0(void);
 void usb_set_address(uint_fast8_t addr);
 void usb_set_configure(void);
+void usb_reset_bulk_toggle(uint_fast8_t is_in); // used by usb_msc.c
 struct usb_string_descriptor *usbserial_get_serialid(void);
 
-// usb_cdc.c
-void usb_fill_serial(struct usb_string_descriptor *desc, int strlen, void *id);
+// String descriptor ids
+enum {
+    USB_STR_ID_MANUFACTURER = 1, USB_STR_ID_PRODUCT, USB_STR_ID_SERIAL,
+};
+
+// Entry in a list of available descriptors
+struct usb_descriptor_s {
+    uint_fast16_t wValue;
+    uint_fast16_t wIndex;
+    const void *desc;
+    uint_fast8_t size;
+};
+
+// Endpoint 0 transfer flags
+enum {
+    UX_READ = 1<<0, UX_SEND = 1<<1, UX_SEND_PROGMEM = 1<<2, UX_SEND_ZLP = 1<<3
+};
+
+// callbacks provided by the usb class code (usb_cdc.c or usb_msc.c)
+extern const struct usb_descriptor_s usb_class_descriptors[];
+extern const uint8_t usb_class_descriptor_count;
+struct usb_ctrlrequest;
+void usb_class_configure(void);
+void usb_class_request(struct usb_ctrlrequest *req);
 void usb_notify_bulk_in(void);
 void usb_notify_bulk_out(void);
+
+// usb_common.c
+void usb_fill_serial(struct usb_string_descriptor *desc, int strlen, void *id);
+void usb_do_stall(void);
+void usb_do_xfer(void *data, uint_fast8_t size, uint_fast8_t flags);
 void usb_notify_ep0(void);
 
 #endif // usb_cdc.h
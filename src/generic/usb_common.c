@@ -0,0 +1,274 @@
+// USB endpoint 0 and descriptor handling shared by the usb classes
+//
+// Copyright (C) 2018  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "autoconf.h" // CONFIG_USB_SERIAL_NUMBER
+#include "board/misc.h" // ARRAY_SIZE
+#include "board/pgm.h" // PROGMEM
+#include "byteorder.h" // cpu_to_le16
+#include "command.h" // DECL_SHUTDOWN
+#include "generic/usbstd.h" // struct usb_string_descriptor
+#include "sched.h" // sched_wake_task
+#include "usb_cdc.h" // usb_notify_ep0
+
+
+/****************************************************************
+ * USB descriptors
+ ****************************************************************/
+
+#define CONCAT1(a, b) a ## b
+#define CONCAT(a, b) CONCAT1(a, b)
+#define USB_STR_MANUFACTURER u"katapult"
+#define USB_STR_PRODUCT CONCAT(u,CONFIG_MCU)
+#define USB_STR_SERIAL CONCAT(u,CONFIG_USB_SERIAL_NUMBER)
+
+#define SIZE_usb_string_langids (sizeof(usb_string_langids) + 2)
+
+static const struct usb_string_descriptor usb_string_langids PROGMEM = {
+    .bLength = SIZE_usb_string_langids,
+    .bDescriptorType = USB_DT_STRING,
+    .data = { cpu_to_le16(USB_LANGID_ENGLISH_US) },
+};
+
+#define SIZE_usb_string_manufacturer \
+    (sizeof(usb_string_manufacturer) + sizeof(USB_STR_MANUFACTURER) - 2)
+
+static const struct usb_string_descriptor usb_string_manufacturer PROGMEM = {
+    .bLength = SIZE_usb_string_manufacturer,
+    .bDescriptorType = USB_DT_STRING,
+    .data = USB_STR_MANUFACTURER,
+};
+
+#define SIZE_usb_string_product \
+    (sizeof(usb_string_product) + sizeof(USB_STR_PRODUCT) - 2)
+
+static const struct usb_string_descriptor usb_string_product PROGMEM = {
+    .bLength = SIZE_usb_string_product,
+    .bDescriptorType = USB_DT_STRING,
+    .data = USB_STR_PRODUCT,
+};
+
+#define SIZE_usb_string_serial \
+    (sizeof(usb_string_serial) + sizeof(USB_STR_SERIAL) - 2)
+
+static const struct usb_string_descriptor usb_string_serial PROGMEM = {
+    .bLength = SIZE_usb_string_serial,
+    .bDescriptorType = USB_DT_STRING,
+    .data = USB_STR_SERIAL,
+};
+
+// String descriptors (the device and config descriptors are
+// provided by the usb class code)
+static const struct usb_descriptor_s usb_string_descriptors[] PROGMEM = {
+    { USB_DT_STRING<<8, 0x0000,
+      &usb_string_langids, SIZE_usb_string_langids },
+    { (USB_DT_STRING<<8) | USB_STR_ID_MANUFACTURER, USB_LANGID_ENGLISH_US,
+      &usb_string_manufacturer, SIZE_usb_string_manufacturer },
+    { (USB_DT_STRING<<8) | USB_STR_ID_PRODUCT, USB_LANGID_ENGLISH_US,
+      &usb_string_product, SIZE_usb_string_product },
+#if !CONFIG_USB_SERIAL_NUMBER_CHIPID
+    { (USB_DT_STRING<<8) | USB_STR_ID_SERIAL, USB_LANGID_ENGLISH_US,
+      &usb_string_serial, SIZE_usb_string_serial },
+#endif
+};
+
+// Fill in a USB serial string descriptor from a chip id
+void
+usb_fill_serial(struct usb_string_descriptor *desc, int strlen, void *id)
+{
+    desc->bLength = sizeof(*desc) + strlen * sizeof(desc->data[0]);
+    desc->bDescriptorType = USB_DT_STRING;
+
+    uint8_t *src = id;
+    int i;
+    for (i = 0; i < strlen; i++) {
+        uint8_t c = i & 1 ? src[i/2] & 0x0f : src[i/2] >> 4;
+        desc->data[i] = c < 10 ? c + '0' : c - 10 + 'A';
+    }
+}
+
+
+/****************************************************************
+ * USB endpoint 0 control message handling
+ ****************************************************************/
+
+static void *usb_xfer_data;
+static uint8_t usb_xfer_size, usb_xfer_flags;
+
+// Set the USB "stall" condition
+void
+usb_do_stall(void)
+{
+    usb_stall_ep0();
+    usb_xfer_flags = 0;
+}
+
+// Transfer data on the usb endpoint 0
+void
+usb_do_xfer(void *data, uint_fast8_t size, uint_fast8_t flags)
+{
+    for (;;) {
+        uint_fast8_t xs = size;
+        if (xs > USB_CDC_EP0_SIZE)
+            xs = USB_CDC_EP0_SIZE;
+        int_fast8_t ret;
+        if (flags & UX_READ)
+            ret = usb_read_ep0(data, xs);
+        else if (NEED_PROGMEM && flags & UX_SEND_PROGMEM)
+            ret = usb_send_ep0_progmem(data, xs);
+        else
+            ret = usb_send_ep0(data, xs);
+        if (ret == xs) {
+            // Success
+            data += xs;
+            size -= xs;
+            if (!size) {
+                // Entire transfer completed successfully
+                if (flags & UX_READ) {
+                    // Send status packet at end of read
+                    flags = UX_SEND;
+                    continue;
+                }
+                if (xs == USB_CDC_EP0_SIZE && flags & UX_SEND_ZLP)
+                    // Must send zero-length-packet
+                    continue;
+                usb_xfer_flags = 0;
+                usb_notify_ep0();
+                return;
+            }
+            continue;
+        }
+        if (ret == -1) {
+            // Interface busy - retry later
+            usb_xfer_data = data;
+            usb_xfer_size = size;
+            usb_xfer_flags = flags;
+            return;
+        }
+        // Error
+        usb_do_stall();
+        return;
+    }
+}
+
+// Find a descriptor in a list of available descriptors
+static const struct usb_descriptor_s *
+usb_find_descriptor(const struct usb_descriptor_s *list, uint_fast8_t count
+                    , struct usb_ctrlrequest *req)
+{
+    uint_fast8_t i;
+    for (i=0; i<count; i++) {
+        const struct usb_descriptor_s *d = &list[i];
+        if (READP(d->wValue) == req->wValue
+            && READP(d->wIndex) == req->wIndex)
+            return d;
+    }
+    return NULL;
+}
+
+static void
+usb_req_get_descriptor(struct usb_ctrlrequest *req)
+{
+    if (req->bRequestType != USB_DIR_IN)
+        goto fail;
+    void *desc = NULL;
+    uint_fast8_t flags, size;
+    const struct usb_descriptor_s *d = usb_find_descriptor(
+        usb_class_descriptors, usb_class_descriptor_count, req);
+    if (!d)
+        d = usb_find_descriptor(usb_string_descriptors
+                                , ARRAY_SIZE(usb_string_descriptors), req);
+    if (d) {
+        flags = NEED_PROGMEM ? UX_SEND_PROGMEM : UX_SEND;
+        size = READP(d->size);
+        desc = (void*)READP(d->desc);
+    }
+    if (CONFIG_USB_SERIAL_NUMBER_CHIPID
+        && req->wValue == ((USB_DT_STRING<<8) | USB_STR_ID_SERIAL)
+        && req->wIndex == USB_LANGID_ENGLISH_US) {
+            struct usb_string_descriptor *usbserial_serialid;
+            usbserial_serialid = usbserial_get_serialid();
+            flags = UX_SEND;
+            size = usbserial_serialid->bLength;
+            desc = (void*)usbserial_serialid;
+    }
+    if (desc) {
+        if (size > req->wLength)
+            size = req->wLength;
+        else if (size < req->wLength)
+            flags |= UX_SEND_ZLP;
+        usb_do_xfer(desc, size, flags);
+        return;
+    }
+fail:
+    usb_do_stall();
+}
+
+static void
+usb_req_set_address(struct usb_ctrlrequest *req)
+{
+    if (req->bRequestType || req->wIndex || req->wLength) {
+        usb_do_stall();
+        return;
+    }
+    usb_set_address(req->wValue);
+}
+
+static void
+usb_req_set_configuration(struct usb_ctrlrequest *req)
+{
+    if (req->bRequestType || req->wValue != 1 || req->wIndex || req->wLength) {
+        usb_do_stall();
+        return;
+    }
+    usb_set_configure();
+    usb_class_configure();
+    usb_do_xfer(NULL, 0, UX_SEND);
+}
+
+static void
+usb_state_ready(void)
+{
+    struct usb_ctrlrequest req;
+    int_fast8_t ret = usb_read_ep0_setup(&req, sizeof(req));
+    if (ret != sizeof(req))
+        return;
+    switch (req.bRequest) {
+    case USB_REQ_GET_DESCRIPTOR: usb_req_get_descriptor(&req); break;
+    case USB_REQ_SET_ADDRESS: usb_req_set_address(&req); break;
+    case USB_REQ_SET_CONFIGURATION: usb_req_set_configuration(&req); break;
+    default: usb_class_request(&req); break;
+    }
+}
+
+// State tracking dispatch
+static struct task_wake usb_ep0_wake;
+
+void
+usb_notify_ep0(void)
+{
+    sched_wake_task(&usb_ep0_wake);
+}
+
+void
+usb_ep0_task(void)
+{
+    if (!sched_check_wake(&usb_ep0_wake))
+        return;
+    if (usb_xfer_flags)
+        usb_do_xfer(usb_xfer_data, usb_xfer_size, usb_xfer_flags);
+    else
+        usb_state_ready();
+}
+DECL_TASK(usb_ep0_task);
+
+void
+usb_shutdown(void)
+{
+    usb_notify_bulk_in();
+    usb_notify_bulk_out();
+    usb_notify_ep0();
+}
+DECL_SHUTDOWN(usb_shutdown);
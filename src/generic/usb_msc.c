@@ -0,0 +1,725 @@
+// Support for a UF2 mass storage drive over USB
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <string.h> // memcpy
+#include "autoconf.h" // CONFIG_LAUNCH_APP_ADDRESS
+#include "board/flash.h" // flash_write_block
+#include "board/misc.h" // console_sendf
+#include "board/pgm.h" // PROGMEM
+#include "board/usb_cdc_ep.h" // USB_CDC_EP_BULK_IN
+#include "byteorder.h" // cpu_to_le16
+#include "canboot.h" // application_jump
+#include "command.h" // struct command_encoder
+#include "generic/usbstd.h" // struct usb_device_descriptor
+#include "sched.h" // sched_wake_task
+#include "usb_cdc.h" // usb_notify_ep0
+
+// The flash protocol is not available over a mass storage interface
+void
+console_sendf(const struct command_encoder *ce, va_list args)
+{
+}
+
+uint32_t
+console_get_tx_space(void)
+{
+    return 0;
+}
+
+int
+console_tx_idle(void)
+{
+    return 1;
+}
+
+
+/****************************************************************
+ * UF2 image writing
+ ****************************************************************/
+
+#define UF2_MAGIC_START0 0x0A324655
+#define UF2_MAGIC_START1 0x9E5D5157
+#define UF2_MAGIC_END 0x0AB16F30
+#define UF2_FLAG_NOT_MAIN_FLASH 0x00000001
+#define UF2_FLAG_FAMILY_ID_PRESENT 0x00002000
+
+// Registered UF2 family ids of the mcu (there is none for the lpc176x)
+#if CONFIG_MACH_STM32F0
+#define UF2_FAMILY_ID 0x647824b6
+#elif CONFIG_MACH_STM32F1
+#define UF2_FAMILY_ID 0x5ee21072
+#elif CONFIG_MACH_STM32F2
+#define UF2_FAMILY_ID 0x5d1a0a2e
+#elif CONFIG_MACH_STM32F4
+#define UF2_FAMILY_ID 0x57755a57
+#elif CONFIG_MACH_STM32G0
+#define UF2_FAMILY_ID 0x300f5633
+#elif CONFIG_MACH_STM32G4
+#define UF2_FAMILY_ID 0x4c71240a
+#elif CONFIG_MACH_STM32H7
+#define UF2_FAMILY_ID 0x6db66082
+#elif CONFIG_MACH_STM32L4
+#define UF2_FAMILY_ID 0x00ff6919
+#else
+#define UF2_FAMILY_ID 0
+#endif
+#if CONFIG_MACH_STM32F407
+#define UF2_FAMILY_ID_ALT 0x6d0922fa
+#else
+#define UF2_FAMILY_ID_ALT UF2_FAMILY_ID
+#endif
+
+struct uf2_block {
+    uint32_t magic_start0, magic_start1, flags, target_addr;
+    uint32_t payload_size, block_no, num_blocks, family_id;
+    uint8_t data[476];
+    uint32_t magic_end;
+};
+
+#define FLASH_END (CONFIG_FLASH_START + CONFIG_FLASH_SIZE)
+
+enum { UF2_IDLE, UF2_WRITING, UF2_COMPLETE, UF2_ERROR };
+
+static uint32_t stage_buf[CONFIG_BLOCK_SIZE / 4];
+static uint32_t uf2_addr, uf2_next_block, uf2_num_blocks, uf2_endtime;
+static uint8_t uf2_state;
+
+// Append data (or erased bytes if data is NULL) to the flash block
+// buffer, writing out each block as it fills
+static int
+uf2_stage(const uint8_t *data, uint32_t count)
+{
+    while (count) {
+        uint32_t pos = uf2_addr % CONFIG_BLOCK_SIZE;
+        uint32_t c = CONFIG_BLOCK_SIZE - pos;
+        if (c > count)
+            c = count;
+        if (data) {
+            memcpy((void*)stage_buf + pos, data, c);
+            data += c;
+        } else {
+            memset((void*)stage_buf + pos, 0xff, c);
+        }
+        uf2_addr += c;
+        count -= c;
+        if (!(uf2_addr % CONFIG_BLOCK_SIZE)) {
+            int ret = flash_write_block(uf2_addr - CONFIG_BLOCK_SIZE
+                                        , stage_buf);
+            if (ret < 0)
+                return ret;
+        }
+    }
+    return 0;
+}
+
+// Process a UF2 block written by the host
+static int
+uf2_process_block(struct uf2_block *b)
+{
+    if (b->magic_start0 != UF2_MAGIC_START0
+        || b->magic_start1 != UF2_MAGIC_START1
+        || b->magic_end != UF2_MAGIC_END
+        || b->flags & UF2_FLAG_NOT_MAIN_FLASH)
+        // Not part of an image (directory and FAT updates)
+        return 0;
+    if (b->flags & UF2_FLAG_FAMILY_ID_PRESENT
+        && (!UF2_FAMILY_ID || (b->family_id != UF2_FAMILY_ID
+                               && b->family_id != UF2_FAMILY_ID_ALT)))
+        // Block of an image for another mcu - ignore it
+        return 0;
+    if (uf2_state >= UF2_COMPLETE)
+        return uf2_state == UF2_ERROR ? -1 : 0;
+    if (b->block_no < uf2_next_block)
+        // Sector rewritten by the host
+        return 0;
+    uint32_t addr = b->target_addr, size = b->payload_size;
+    if (b->block_no != uf2_next_block || !b->num_blocks
+        || (uf2_next_block && b->num_blocks != uf2_num_blocks)
+        || size > sizeof(b->data) || addr < CONFIG_LAUNCH_APP_ADDRESS
+        || addr > FLASH_END - size
+        || (uf2_next_block && addr < uf2_addr))
+        // Blocks must be sent in order and fit in the application area
+        goto fail;
+    if (!uf2_next_block) {
+        uf2_state = UF2_WRITING;
+        uf2_num_blocks = b->num_blocks;
+        uf2_addr = CONFIG_LAUNCH_APP_ADDRESS;
+    }
+    // Fill any gap in the image with erased bytes
+    if (uf2_stage(NULL, addr - uf2_addr) < 0 || uf2_stage(b->data, size) < 0)
+        goto fail;
+    if (++uf2_next_block < uf2_num_blocks)
+        return 0;
+    // Final block - flush the last partial flash block
+    uint32_t pos = uf2_addr % CONFIG_BLOCK_SIZE;
+    if (pos && uf2_stage(NULL, CONFIG_BLOCK_SIZE - pos) < 0)
+        goto fail;
+    if (flash_complete() < 0)
+        goto fail;
+    uf2_state = UF2_COMPLETE;
+    uf2_endtime = timer_read_time() + timer_from_us(500000);
+    return 0;
+fail:
+    uf2_state = UF2_ERROR;
+    return -1;
+}
+
+// Start the new application once the host has finished writing
+void
+uf2_complete_task(void)
+{
+    if (uf2_state == UF2_COMPLETE
+        && timer_is_before(uf2_endtime, timer_read_time())) {
+        if (CONFIG_ENABLE_FLASH_BANK_SWAP)
+            flash_bank_commit();
+        application_jump();
+    }
+}
+DECL_TASK(uf2_complete_task);
+
+
+/****************************************************************
+ * Virtual FAT16 drive
+ ****************************************************************/
+
+#define SECTOR_SIZE 512
+#define NUM_SECTORS 8000
+#define RESERVED_SECTORS 1
+#define SECTORS_PER_FAT 32
+#define ROOT_DIR_ENTRIES 64
+#define START_FAT0 RESERVED_SECTORS
+#define START_FAT1 (START_FAT0 + SECTORS_PER_FAT)
+#define START_ROOTDIR (START_FAT1 + SECTORS_PER_FAT)
+#define START_CLUSTERS (START_ROOTDIR + ROOT_DIR_ENTRIES * 32 / SECTOR_SIZE)
+
+struct fat_boot_sector {
+    uint8_t jump[3];
+    uint8_t oem[8];
+    uint16_t sector_size;
+    uint8_t sectors_per_cluster;
+    uint16_t reserved_sectors;
+    uint8_t fat_count;
+    uint16_t root_entries;
+    uint16_t total_sectors16;
+    uint8_t media;
+    uint16_t sectors_per_fat;
+    uint16_t sectors_per_track;
+    uint16_t heads;
+    uint32_t hidden_sectors;
+    uint32_t total_sectors32;
+    uint8_t drive_number;
+    uint8_t reserved;
+    uint8_t ext_signature;
+    uint32_t serial;
+    uint8_t label[11];
+    uint8_t fs_type[8];
+} PACKED;
+
+struct fat_dir_entry {
+    uint8_t name[11];
+    uint8_t attrs;
+    uint8_t reserved[10];
+    uint16_t mtime, mdate;
+    uint16_t cluster;
+    uint32_t size;
+} PACKED;
+
+#define VOLUME_LABEL "KATAPULT   "
+
+static const struct fat_boot_sector boot_sector = {
+    .jump = { 0xeb, 0x3c, 0x90 },
+    .oem = "KATAPULT",
+    .sector_size = cpu_to_le16(SECTOR_SIZE),
+    .sectors_per_cluster = 1,
+    .reserved_sectors = cpu_to_le16(RESERVED_SECTORS),
+    .fat_count = 2,
+    .root_entries = cpu_to_le16(ROOT_DIR_ENTRIES),
+    .total_sectors16 = cpu_to_le16(NUM_SECTORS),
+    .media = 0xf8,
+    .sectors_per_fat = cpu_to_le16(SECTORS_PER_FAT),
+    .sectors_per_track = cpu_to_le16(1),
+    .heads = cpu_to_le16(1),
+    .drive_number = 0x80,
+    .ext_signature = 0x29,
+    .serial = cpu_to_le32(0x00420042),
+    .label = VOLUME_LABEL,
+    .fs_type = "FAT16   ",
+};
+
+static const char info_file[] =
+    "UF2 Bootloader Katapult " CONFIG_KATAPULT_VERSION "\r\n"
+    "Model: " CONFIG_MCU "\r\n"
+    "Board-ID: Katapult-" CONFIG_MCU "\r\n";
+
+static const struct fat_dir_entry root_dir[] = {
+    { .name = VOLUME_LABEL, .attrs = 0x28 },
+    { .name = "INFO_UF2TXT", .attrs = 0x01, .cluster = cpu_to_le16(2),
+      .size = cpu_to_le32(sizeof(info_file) - 1) },
+};
+
+static uint8_t sector_buf[SECTOR_SIZE] __aligned(4);
+
+// Generate the contents of a sector of the virtual drive
+static void
+fat_read_sector(uint32_t lba)
+{
+    memset(sector_buf, 0, sizeof(sector_buf));
+    if (lba == 0) {
+        memcpy(sector_buf, &boot_sector, sizeof(boot_sector));
+        sector_buf[510] = 0x55;
+        sector_buf[511] = 0xaa;
+    } else if (lba == START_FAT0 || lba == START_FAT1) {
+        // Media descriptor, reserved entry, and the info file cluster
+        static const uint8_t fat_start[] = {
+            0xf8, 0xff, 0xff, 0xff, 0xff, 0xff
+        };
+        memcpy(sector_buf, fat_start, sizeof(fat_start));
+    } else if (lba == START_ROOTDIR) {
+        memcpy(sector_buf, root_dir, sizeof(root_dir));
+    } else if (lba == START_CLUSTERS) {
+        memcpy(sector_buf, info_file, sizeof(info_file) - 1);
+    }
+}
+
+// Process a sector written by the host
+static int
+fat_write_sector(uint32_t lba)
+{
+    if (lba < START_CLUSTERS)
+        // Filesystem metadata is discarded
+        return 0;
+    return uf2_process_block((void*)sector_buf);
+}
+
+
+/****************************************************************
+ * SCSI commands
+ ****************************************************************/
+
+enum {
+    SCSI_TEST_UNIT_READY = 0x00, SCSI_REQUEST_SENSE = 0x03,
+    SCSI_INQUIRY = 0x12, SCSI_MODE_SENSE6 = 0x1a, SCSI_START_STOP = 0x1b,
+    SCSI_PREVENT_ALLOW = 0x1e, SCSI_READ_FORMAT_CAPACITIES = 0x23,
+    SCSI_READ_CAPACITY10 = 0x25, SCSI_READ10 = 0x28, SCSI_WRITE10 = 0x2a,
+    SCSI_VERIFY10 = 0x2f, SCSI_SYNC_CACHE10 = 0x35, SCSI_MODE_SENSE10 = 0x5a,
+};
+
+enum {
+    SENSE_MEDIUM_ERROR = 0x03, SENSE_ILLEGAL_REQUEST = 0x05,
+};
+
+enum {
+    ASC_WRITE_ERROR = 0x0c, ASC_INVALID_COMMAND = 0x20,
+    ASC_LBA_OUT_OF_RANGE = 0x21, ASC_INVALID_FIELD = 0x24,
+};
+
+#define MSC_CBW_SIGNATURE 0x43425355
+#define MSC_CSW_SIGNATURE 0x53425355
+
+enum { CSW_PASSED, CSW_FAILED, CSW_PHASE_ERROR };
+
+struct msc_cbw {
+    uint32_t signature, tag, data_length;
+    uint8_t flags, lun, cb_length;
+    uint8_t cb[16];
+} PACKED;
+
+struct msc_csw {
+    uint32_t signature, tag, residue;
+    uint8_t status;
+} PACKED;
+
+static const uint8_t inquiry_data[] = {
+    0x00, 0x80, 0x04, 0x02, 31, 0x00, 0x00, 0x00,
+    'K', 'a', 't', 'a', 'p', 'u', 'l', 't',
+    'U', 'F', '2', ' ', 'B', 'o', 'o', 't',
+    'l', 'o', 'a', 'd', 'e', 'r', ' ', ' ',
+    '1', '.', '0', ' ',
+};
+
+static struct msc_csw csw;
+static uint8_t sense_key, sense_asc;
+
+static void
+scsi_fail(uint8_t key, uint8_t asc)
+{
+    sense_key = key;
+    sense_asc = asc;
+    csw.status = CSW_FAILED;
+}
+
+static void
+put_be32(uint8_t *p, uint32_t v)
+{
+    v = cpu_to_be32(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static uint32_t
+get_be32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return be32_to_cpu(v);
+}
+
+// Prepare the response to a SCSI command.  Returns the length of the
+// response (or of the data expected from the host).
+static uint32_t
+scsi_process(uint8_t *cb, int dir_in, uint32_t *sectors, uint32_t *lba)
+{
+    uint8_t *buf = sector_buf;
+    memset(buf, 0, SECTOR_SIZE);
+    switch (cb[0]) {
+    case SCSI_TEST_UNIT_READY: case SCSI_START_STOP: case SCSI_PREVENT_ALLOW:
+    case SCSI_VERIFY10: case SCSI_SYNC_CACHE10:
+        return 0;
+    case SCSI_REQUEST_SENSE:
+        buf[0] = 0x70;
+        buf[2] = sense_key;
+        buf[7] = 10;
+        buf[12] = sense_asc;
+        sense_key = sense_asc = 0;
+        return 18;
+    case SCSI_INQUIRY:
+        if (cb[1] & 0x01)
+            // Vital product data pages are not supported
+            break;
+        memcpy(buf, inquiry_data, sizeof(inquiry_data));
+        return sizeof(inquiry_data);
+    case SCSI_MODE_SENSE6:
+        buf[0] = 3;
+        return 4;
+    case SCSI_MODE_SENSE10:
+        buf[1] = 6;
+        return 8;
+    case SCSI_READ_FORMAT_CAPACITIES:
+        buf[3] = 8;
+        put_be32(&buf[4], NUM_SECTORS);
+        put_be32(&buf[8], SECTOR_SIZE);
+        buf[8] = 0x02; // Formatted media (shares the block length word)
+        return 12;
+    case SCSI_READ_CAPACITY10:
+        put_be32(&buf[0], NUM_SECTORS - 1);
+        put_be32(&buf[4], SECTOR_SIZE);
+        return 8;
+    case SCSI_READ10: case SCSI_WRITE10: {
+        if (dir_in != (cb[0] == SCSI_READ10)) {
+            csw.status = CSW_PHASE_ERROR;
+            return 0;
+        }
+        uint32_t start = get_be32(&cb[2]), count = (cb[7] << 8) | cb[8];
+        if (start > NUM_SECTORS || count > NUM_SECTORS - start) {
+            scsi_fail(SENSE_ILLEGAL_REQUEST, ASC_LBA_OUT_OF_RANGE);
+            return 0;
+        }
+        *lba = start;
+        *sectors = count;
+        return count * SECTOR_SIZE;
+    }
+    default:
+        scsi_fail(SENSE_ILLEGAL_REQUEST, ASC_INVALID_COMMAND);
+        return 0;
+    }
+    scsi_fail(SENSE_ILLEGAL_REQUEST, ASC_INVALID_FIELD);
+    return 0;
+}
+
+
+/****************************************************************
+ * Bulk only transport
+ ****************************************************************/
+
+// The board usb drivers do not support stalling the bulk endpoints,
+// so data phases are always completed.  Short responses are padded
+// and unexpected host data is discarded, with the difference reported
+// in the status residue.
+
+enum { MS_CBW, MS_DATA_IN, MS_DATA_OUT, MS_CSW };
+
+static uint32_t cbw_buf[USB_CDC_EP_BULK_OUT_SIZE / 4];
+static uint32_t xfer_remaining, xfer_sectors, xfer_lba;
+static uint16_t buf_pos, buf_len;
+static uint8_t msc_state;
+
+static struct task_wake usb_bulk_in_wake, usb_bulk_out_wake;
+
+void
+usb_notify_bulk_in(void)
+{
+    sched_wake_task(&usb_bulk_in_wake);
+}
+
+void
+usb_notify_bulk_out(void)
+{
+    sched_wake_task(&usb_bulk_out_wake);
+}
+
+static void
+msc_reset(void)
+{
+    msc_state = MS_CBW;
+    usb_notify_bulk_out();
+}
+
+// Start processing a command block wrapper sent by the host
+static void
+msc_process_cbw(struct msc_cbw *cbw)
+{
+    csw.signature = cpu_to_le32(MSC_CSW_SIGNATURE);
+    csw.tag = cbw->tag;
+    csw.status = CSW_PASSED;
+    uint32_t host_len = le32_to_cpu(cbw->data_length);
+    int dir_in = !!(cbw->flags & USB_DIR_IN);
+    xfer_sectors = 0;
+    uint32_t len = scsi_process(cbw->cb, dir_in, &xfer_sectors, &xfer_lba);
+    if (len > host_len)
+        len = host_len;
+    csw.residue = cpu_to_le32(host_len - len);
+    xfer_remaining = host_len;
+    buf_pos = 0;
+    buf_len = xfer_sectors ? 0 : len;
+    if (!host_len) {
+        msc_state = MS_CSW;
+        usb_notify_bulk_in();
+    } else if (dir_in) {
+        msc_state = MS_DATA_IN;
+        usb_notify_bulk_in();
+    } else {
+        msc_state = MS_DATA_OUT;
+    }
+}
+
+// Transmit the data phase of a command
+static void
+msc_send_data(void)
+{
+    while (xfer_remaining) {
+        if (buf_pos >= buf_len) {
+            // Load the next sector or pad the response
+            if (xfer_sectors) {
+                fat_read_sector(xfer_lba++);
+                xfer_sectors--;
+            } else {
+                memset(sector_buf, 0, sizeof(sector_buf));
+            }
+            buf_pos = 0;
+            buf_len = SECTOR_SIZE;
+        }
+        uint32_t count = buf_len - buf_pos;
+        if (count > USB_CDC_EP_BULK_IN_SIZE)
+            count = USB_CDC_EP_BULK_IN_SIZE;
+        if (count > xfer_remaining)
+            count = xfer_remaining;
+        int_fast8_t ret = usb_send_bulk_in(&sector_buf[buf_pos], count);
+        if (ret <= 0)
+            return;
+        buf_pos += ret;
+        xfer_remaining -= ret;
+    }
+    msc_state = MS_CSW;
+}
+
+// Receive the data phase of a command
+static int
+msc_recv_data(void)
+{
+    uint32_t max_len = SECTOR_SIZE - buf_pos;
+    if (max_len > USB_CDC_EP_BULK_OUT_SIZE)
+        max_len = USB_CDC_EP_BULK_OUT_SIZE;
+    int_fast8_t ret = usb_read_bulk_out(&sector_buf[buf_pos], max_len);
+    if (ret < 0)
+        return -1;
+    buf_pos += ret;
+    xfer_remaining = ret > xfer_remaining ? 0 : xfer_remaining - ret;
+    if (buf_pos >= SECTOR_SIZE || !xfer_remaining) {
+        if (xfer_sectors && buf_pos >= SECTOR_SIZE) {
+            if (fat_write_sector(xfer_lba++) < 0)
+                scsi_fail(SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR);
+            xfer_sectors--;
+        }
+        buf_pos = 0;
+    }
+    if (!xfer_remaining) {
+        msc_state = MS_CSW;
+        usb_notify_bulk_in();
+    }
+    return 0;
+}
+
+void
+usb_bulk_in_task(void)
+{
+    if (!sched_check_wake(&usb_bulk_in_wake))
+        return;
+    if (msc_state == MS_DATA_IN)
+        msc_send_data();
+    if (msc_state != MS_CSW)
+        return;
+    if (usb_send_bulk_in(&csw, sizeof(csw)) < 0)
+        return;
+    msc_reset();
+}
+DECL_TASK(usb_bulk_in_task);
+
+void
+usb_bulk_out_task(void)
+{
+    if (!sched_check_wake(&usb_bulk_out_wake))
+        return;
+    for (;;) {
+        if (msc_state == MS_DATA_OUT) {
+            if (msc_recv_data() < 0)
+                return;
+            continue;
+        }
+        if (msc_state != MS_CBW)
+            return;
+        int_fast8_t ret = usb_read_bulk_out(cbw_buf, sizeof(cbw_buf));
+        if (ret < 0)
+            return;
+        struct msc_cbw *cbw = (void*)cbw_buf;
+        if (ret == sizeof(*cbw) && cbw->signature == MSC_CBW_SIGNATURE)
+            msc_process_cbw(cbw);
+    }
+}
+DECL_TASK(usb_bulk_out_task);
+
+
+/****************************************************************
+ * USB descriptors
+ ****************************************************************/
+
+// Device descriptor
+static const struct usb_device_descriptor msc_device_descriptor PROGMEM = {
+    .bLength = sizeof(msc_device_descriptor),
+    .bDescriptorType = USB_DT_DEVICE,
+    .bcdUSB = cpu_to_le16(0x0200),
+    .bDeviceClass = USB_CLASS_PER_INTERFACE,
+    .bMaxPacketSize0 = USB_CDC_EP0_SIZE,
+    .idVendor = cpu_to_le16(CONFIG_USB_VENDOR_ID),
+    .idProduct = cpu_to_le16(CONFIG_USB_DEVICE_ID),
+    .bcdDevice = cpu_to_le16(0x0100),
+    .iManufacturer = USB_STR_ID_MANUFACTURER,
+    .iProduct = USB_STR_ID_PRODUCT,
+    .iSerialNumber = USB_STR_ID_SERIAL,
+    .bNumConfigurations = 1,
+};
+
+// Config descriptor
+static const struct config_s {
+    struct usb_config_descriptor config;
+    struct usb_interface_descriptor iface0;
+    struct usb_endpoint_descriptor ep1;
+    struct usb_endpoint_descriptor ep2;
+} PACKED msc_config_descriptor PROGMEM = {
+    .config = {
+        .bLength = sizeof(msc_config_descriptor.config),
+        .bDescriptorType = USB_DT_CONFIG,
+        .wTotalLength = cpu_to_le16(sizeof(msc_config_descriptor)),
+        .bNumInterfaces = 1,
+        .bConfigurationValue = 1,
+        .bmAttributes = 0xC0,
+        .bMaxPower = 50,
+    },
+    .iface0 = {
+        .bLength = sizeof(msc_config_descriptor.iface0),
+        .bDescriptorType = USB_DT_INTERFACE,
+        .bInterfaceNumber = 0,
+        .bNumEndpoints = 2,
+        .bInterfaceClass = USB_CLASS_MASS_STORAGE,
+        .bInterfaceSubClass = 0x06, // SCSI transparent command set
+        .bInterfaceProtocol = 0x50, // Bulk only transport
+    },
+    .ep1 = {
+        .bLength = sizeof(msc_config_descriptor.ep1),
+        .bDescriptorType = USB_DT_ENDPOINT,
+        .bEndpointAddress = USB_CDC_EP_BULK_OUT,
+        .bmAttributes = USB_ENDPOINT_XFER_BULK,
+        .wMaxPacketSize = cpu_to_le16(USB_CDC_EP_BULK_OUT_SIZE),
+    },
+    .ep2 = {
+        .bLength = sizeof(msc_config_descriptor.ep2),
+        .bDescriptorType = USB_DT_ENDPOINT,
+        .bEndpointAddress = USB_CDC_EP_BULK_IN | USB_DIR_IN,
+        .bmAttributes = USB_ENDPOINT_XFER_BULK,
+        .wMaxPacketSize = cpu_to_le16(USB_CDC_EP_BULK_IN_SIZE),
+    },
+};
+
+// Class specific descriptors
+const struct usb_descriptor_s usb_class_descriptors[] PROGMEM = {
+    { USB_DT_DEVICE<<8, 0x0000,
+      &msc_device_descriptor, sizeof(msc_device_descriptor) },
+    { USB_DT_CONFIG<<8, 0x0000,
+      &msc_config_descriptor, sizeof(msc_config_descriptor) },
+};
+
+const uint8_t usb_class_descriptor_count = ARRAY_SIZE(usb_class_descriptors);
+
+
+/****************************************************************
+ * USB class specific control requests
+ ****************************************************************/
+
+#define MSC_REQ_GET_MAX_LUN 0xfe
+#define MSC_REQ_RESET 0xff
+
+void
+usb_class_configure(void)
+{
+    msc_reset();
+}
+
+// The bulk endpoints are never halted, but the host restarts them at
+// DATA0 after clearing a halt (as part of the reset recovery)
+static void
+usb_req_clear_feature(struct usb_ctrlrequest *req)
+{
+    uint_fast8_t ep = req->wIndex;
+    if (req->bRequestType != 0x02 || req->wValue != USB_ENDPOINT_HALT
+        || req->wLength || (ep != USB_CDC_EP_BULK_OUT
+                            && ep != (USB_CDC_EP_BULK_IN | USB_DIR_IN))) {
+        usb_do_stall();
+        return;
+    }
+    usb_reset_bulk_toggle(ep & USB_DIR_IN);
+    usb_do_xfer(NULL, 0, UX_SEND);
+}
+
+static void
+usb_req_get_max_lun(struct usb_ctrlrequest *req)
+{
+    if (req->bRequestType != 0xa1 || req->wValue || !req->wLength) {
+        usb_do_stall();
+        return;
+    }
+    static uint8_t max_lun;
+    usb_do_xfer(&max_lun, sizeof(max_lun), UX_SEND);
+}
+
+static void
+usb_req_msc_reset(struct usb_ctrlrequest *req)
+{
+    if (req->bRequestType != 0x21 || req->wValue || req->wLength) {
+        usb_do_stall();
+        return;
+    }
+    msc_reset();
+    usb_do_xfer(NULL, 0, UX_SEND);
+}
+
+void
+usb_class_request(struct usb_ctrlrequest *req)
+{
+    switch (req->bRequest) {
+    case USB_REQ_CLEAR_FEATURE: usb_req_clear_feature(req); break;
+    case MSC_REQ_GET_MAX_LUN: usb_req_get_max_lun(req); break;
+    case MSC_REQ_RESET: usb_req_msc_reset(req); break;
+    default: usb_do_stall(); break;
+    }
+}
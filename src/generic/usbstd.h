@@ -26,6 +26,8 @@
 #define USB_REQ_SET_INTERFACE           0x0B
 #define USB_REQ_SYNCH_FRAME             0x0C
 
+#define USB_ENDPOINT_HALT               0x00
+
 struct usb_ctrlrequest {
     uint8_t bRequestType;
     uint8_t bRequest;
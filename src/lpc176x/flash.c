@@ -15,10 +15,15 @@
 #define IAP_CMD_WRITE       51
 #define IAP_CMD_ERASE       52
 #define IAP_FREQ            (CONFIG_CLOCK_FREQ / 1000)
-#define IAP_BUF_MIN_SIZE        256
+// Flash is staged in 4KiB chunks (the largest IAP write size).  The
+// chunks are aligned, so each lies within a single sector.
+#define IAP_BUF_SIZE        4096
+// Each IAP write runs with irqs disabled and takes about 1ms per 256
+// bytes, so a chunk is programmed with 256 byte writes
+#define IAP_WRITE_SIZE      256
 typedef void (*IAP)(uint32_t *, uint32_t *);
 
-static uint8_t iap_buf[IAP_BUF_MIN_SIZE] __aligned(4);
+static uint8_t iap_buf[IAP_BUF_SIZE] __aligned(4);
 static uint32_t next_address;
 static uint32_t page_write_count;
 
@@ -33,9 +38,9 @@ flash_get_sector_index(uint32_t addr)
 }
 
 
-// Return the flash page size at the given address
-static uint32_t
-flash_get_sector_size(uint32_t addr)
+// Return the flash page (sector) size at the given address
+uint32_t
+flash_get_page_size(uint32_t addr)
 {
     if (addr < 0x00010000)
         return 4 * 1024;
@@ -91,7 +96,7 @@ write_flash(uint32_t flash_address, uint32_t* data, uint32_t len)
 static int
 write_buffer(uint32_t flash_address, uint32_t* data, uint32_t len)
 {
-    uint32_t flash_sector_size = flash_get_sector_size(flash_address);
+    uint32_t flash_sector_size = flash_get_page_size(flash_address);
     uint32_t sector = flash_get_sector_index(flash_address);
     uint32_t page_address = ALIGN_DOWN(flash_address, flash_sector_size);
     if (page_address == flash_address) {
@@ -118,9 +123,13 @@ write_buffer(uint32_t flash_address, uint32_t* data, uint32_t len)
             return -2;
         }
     }
-    unlock_flash(sector);
-    if (write_flash(flash_address, data, len) != 0)
-        return -4;
+    uint32_t pos;
+    for (pos = 0; pos < len; pos += IAP_WRITE_SIZE) {
+        unlock_flash(sector);
+        if (write_flash(flash_address + pos, &data[pos / 4]
+                        , IAP_WRITE_SIZE) != 0)
+            return -4;
+    }
     return 0;
 }
 
@@ -130,18 +139,21 @@ flash_write_block(uint32_t block_address, uint32_t *data)
     if (block_address & (CONFIG_BLOCK_SIZE - 1))
         // Not a block aligned address
         return -1;
-    if (CONFIG_BLOCK_SIZE < IAP_BUF_MIN_SIZE) {
+    if (CONFIG_BLOCK_SIZE < IAP_BUF_SIZE) {
         if (block_address != next_address) {
-            if ((block_address | next_address) & (IAP_BUF_MIN_SIZE - 1))
+            if (block_address + CONFIG_BLOCK_SIZE == next_address)
+                // Retransmitted request - just ignore
+                return 0;
+            if ((block_address | next_address) & (IAP_BUF_SIZE - 1))
                 // out of order request
                 return -2;
             next_address = block_address;
         }
-        uint32_t buf_idx = block_address & (IAP_BUF_MIN_SIZE - 1);
+        uint32_t buf_idx = block_address & (IAP_BUF_SIZE - 1);
         memcpy(&iap_buf[buf_idx], data, CONFIG_BLOCK_SIZE);
-        if (buf_idx == IAP_BUF_MIN_SIZE - CONFIG_BLOCK_SIZE) {
+        if (buf_idx == IAP_BUF_SIZE - CONFIG_BLOCK_SIZE) {
             int ret = write_buffer(
-                block_address - buf_idx, (uint32_t*)iap_buf, IAP_BUF_MIN_SIZE
+                block_address - buf_idx, (uint32_t*)iap_buf, IAP_BUF_SIZE
             );
             if (ret < 0)
                 return ret;
@@ -155,15 +167,17 @@ flash_write_block(uint32_t block_address, uint32_t *data)
 int
 flash_complete(void)
 {
-    if (CONFIG_BLOCK_SIZE < IAP_BUF_MIN_SIZE) {
-        uint32_t buf_idx = next_address & (IAP_BUF_MIN_SIZE - 1);
+    if (CONFIG_BLOCK_SIZE < IAP_BUF_SIZE) {
+        uint32_t buf_idx = next_address & (IAP_BUF_SIZE - 1);
         if (buf_idx) {
-            memset(&iap_buf[buf_idx], 0xFF, (IAP_BUF_MIN_SIZE - buf_idx));
+            memset(&iap_buf[buf_idx], 0xFF, (IAP_BUF_SIZE - buf_idx));
             int ret = write_buffer(
-                next_address - buf_idx, (uint32_t*)iap_buf, IAP_BUF_MIN_SIZE
+                next_address - buf_idx, (uint32_t*)iap_buf, IAP_BUF_SIZE
             );
             if (ret < 0)
                 return ret;
+            // Allow a new write sequence to start at any aligned address
+            next_address += IAP_BUF_SIZE - buf_idx;
         }
     }
     return page_write_count;
@@ -71,18 +71,55 @@ serial_enable_tx_irq(void)
     }
 }
 
-void
-serial_init(void)
+static void
+uart_set_divisor(uint32_t div)
 {
-    // Setup baud
-    enable_pclock(PCLK_UARTx);
     LPC_UARTx->LCR = (1<<7); // set DLAB bit
-    uint32_t pclk = get_pclock_frequency(PCLK_UARTx);
-    uint32_t div = pclk / (CONFIG_SERIAL_BAUD * 16);
     LPC_UARTx->DLL = div & 0xff;
     LPC_UARTx->DLM = (div >> 8) & 0xff;
     LPC_UARTx->FDR = 0x10;
     LPC_UARTx->LCR = 3; // 8N1 ; clear DLAB bit
+}
+
+// Return the baud rate generated for a requested rate (or 0 if invalid)
+uint32_t
+serial_calc_baud(uint32_t baud)
+{
+    uint32_t pclk = get_pclock_frequency(PCLK_UARTx);
+    uint32_t div = DIV_ROUND_CLOSEST(pclk / 16, baud);
+    if (!div || div > 0xffff)
+        return 0;
+    return pclk / (div * 16);
+}
+
+// Check if the last byte handed to the uart has been transmitted
+int
+serial_tx_done(void)
+{
+    return !!(LPC_UARTx->LSR & (1<<6));
+}
+
+// Change the baud rate after the last byte has been transmitted
+void
+serial_set_baud(uint32_t baud)
+{
+    while (!(LPC_UARTx->LSR & (1<<6)))
+        ;
+    uint32_t pclk = get_pclock_frequency(PCLK_UARTx);
+    uint32_t div = DIV_ROUND_CLOSEST(pclk / 16, baud);
+    if (baud == CONFIG_SERIAL_BAUD)
+        // Use the same divisor as serial_init()
+        div = pclk / (CONFIG_SERIAL_BAUD * 16);
+    uart_set_divisor(div);
+}
+
+void
+serial_init(void)
+{
+    // Setup baud
+    enable_pclock(PCLK_UARTx);
+    uint32_t pclk = get_pclock_frequency(PCLK_UARTx);
+    uart_set_divisor(pclk / (CONFIG_SERIAL_BAUD * 16));
 
     // Enable fifo
     LPC_UARTx->FCR = 0x01;
@@ -243,6 +243,16 @@ usb_set_configure(void)
     usb_irq_enable();
 }
 
+// Restart a bulk endpoint at DATA0 (after a CLEAR_FEATURE request).
+// Clearing the stall bit of an endpoint also resets its data toggle.
+void
+usb_reset_bulk_toggle(uint_fast8_t is_in)
+{
+    usb_irq_disable();
+    sie_cmd_write(SIE_CMD_SET_ENDPOINT_STATUS | (is_in ? EP5IN : EP2OUT), 0);
+    usb_irq_enable();
+}
+
 // Force a USB disconnect (used during reboot into bootloader)
 void
 usb_disconnect(void)
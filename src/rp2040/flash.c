@@ -67,6 +67,13 @@ check_valid_flash_address(uint32_t address)
     return 0;
 }
 
+// Return the size of the erase unit at the given address
+uint32_t
+flash_get_page_size(uint32_t addr)
+{
+    return SECTOR_SIZE;
+}
+
 int
 flash_write_block(uint32_t block_address, uint32_t *data)
 {
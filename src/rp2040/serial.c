@@ -108,6 +108,45 @@ serial_enable_tx_irq(void)
     }
 }
 
+static uint32_t
+uart_get_pclock(void)
+{
+    if (UARTx == uart0_hw)
+        return get_pclock_frequency(RESETS_RESET_UART0_BITS);
+    return get_pclock_frequency(RESETS_RESET_UART1_BITS);
+}
+
+// Return the baud rate generated for a requested rate (or 0 if invalid)
+uint32_t
+serial_calc_baud(uint32_t baud)
+{
+    uint32_t pclk = uart_get_pclock();
+    uint32_t div = DIV_ROUND_CLOSEST(pclk * 4, baud);
+    if (div < (1 << 6) || div >> 6 > 0xffff)
+        return 0;
+    return pclk * 4 / div;
+}
+
+// Check if the last byte handed to the uart has been transmitted
+int
+serial_tx_done(void)
+{
+    return !(UARTx->fr & UART_UARTFR_BUSY_BITS);
+}
+
+// Change the baud rate after the last byte has been transmitted
+void
+serial_set_baud(uint32_t baud)
+{
+    while (UARTx->fr & UART_UARTFR_BUSY_BITS)
+        ;
+    uint32_t div = DIV_ROUND_CLOSEST(uart_get_pclock() * 4, baud);
+    UARTx->ibrd = div >> 6;
+    UARTx->fbrd = div & 0x3f;
+    // The divisor is latched on a write to lcr_h
+    UARTx->lcr_h = UART_UARTLCR_H_FEN_BITS | UART_UARTLCR_H_WLEN_BITS;
+}
+
 void
 serial_init(void)
 {
@@ -4,6 +4,7 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include "autoconf.h" // CONFIG_ENABLE_BOOT_TIMESTAMPS
 #include "board/io.h" // readb
 #include "board/misc.h" // jump_to_application
 #include "bootentry.h" // bootentry_check
@@ -54,8 +55,13 @@ sched_check_wake(struct task_wake *w)
 void
 sched_main(void)
 {
+    if (CONFIG_ENABLE_BOOT_TIMESTAMPS)
+        boot_timestamp_record(BOOT_PHASE_MAIN);
     timer_setup();
-    if (!bootentry_check())
+    int enter_bootloader = bootentry_check();
+    if (CONFIG_ENABLE_BOOT_TIMESTAMPS)
+        boot_timestamp_record(BOOT_PHASE_ENTRY);
+    if (!enter_bootloader)
         application_jump();
 
     // Run all init functions marked with DECL_INIT()
@@ -0,0 +1,497 @@
+// Flash an application from a FAT formatted SD card
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <string.h> // memcmp
+#include "autoconf.h" // CONFIG_SDCARD_FILENAME
+#include "board/flash.h" // flash_write_block
+#include "board/gpio.h" // gpio_out_setup
+#include "board/misc.h" // timer_read_time
+#include "bootentry.h" // sdcard_install
+#include "byteorder.h" // le32_to_cpu
+#include "canboot.h" // udelay
+#include "ctr.h" // DECL_CTR
+
+DECL_CTR("DECL_SDCARD_PIN SCK " __stringify(CONFIG_SDCARD_SCK_PIN));
+DECL_CTR("DECL_SDCARD_PIN MOSI " __stringify(CONFIG_SDCARD_MOSI_PIN));
+DECL_CTR("DECL_SDCARD_PIN MISO " __stringify(CONFIG_SDCARD_MISO_PIN));
+DECL_CTR("DECL_SDCARD_PIN CS " __stringify(CONFIG_SDCARD_CS_PIN));
+DECL_CTR("DECL_SDCARD_PIN DETECT " __stringify(CONFIG_SDCARD_DETECT_PIN));
+// Generated by buildcommands.py
+extern uint32_t sdcard_gpio[4];
+extern int32_t sdcard_detect_gpio, sdcard_detect_high, sdcard_detect_pullup;
+
+#define SECTOR_SIZE 512
+
+static struct gpio_out sck, mosi, cs;
+static struct gpio_in miso;
+static uint8_t spi_slow, block_addressing;
+static uint32_t sector[SECTOR_SIZE / 4];
+
+
+/****************************************************************
+ * Software SPI
+ ****************************************************************/
+
+// Transfer a byte in SPI mode 0
+static uint8_t
+spi_byte(uint8_t out)
+{
+    uint8_t in = 0;
+    int i;
+    for (i = 0; i < 8; i++) {
+        gpio_out_write(mosi, out & 0x80);
+        out <<= 1;
+        if (spi_slow)
+            udelay(2);
+        gpio_out_write(sck, 1);
+        in = (in << 1) | gpio_in_read(miso);
+        if (spi_slow)
+            udelay(2);
+        gpio_out_write(sck, 0);
+    }
+    return in;
+}
+
+
+/****************************************************************
+ * SD card access
+ ****************************************************************/
+
+#define SD_TIMEOUT_US 500000
+
+// Send a command and return its R1 response
+static uint8_t
+sd_command(uint8_t cmd, uint32_t arg)
+{
+    uint8_t crc = cmd == 0 ? 0x95 : (cmd == 8 ? 0x87 : 0x01);
+    uint8_t msg[6] = { 0x40 | cmd, arg >> 24, arg >> 16, arg >> 8, arg, crc };
+    spi_byte(0xff);
+    int i;
+    for (i = 0; i < sizeof(msg); i++)
+        spi_byte(msg[i]);
+    for (i = 0; i < 10; i++) {
+        uint8_t r1 = spi_byte(0xff);
+        if (!(r1 & 0x80))
+            return r1;
+    }
+    return 0xff;
+}
+
+// Read trailing response bytes (R3/R7) following an R1 response
+static uint32_t
+sd_read_word(void)
+{
+    uint32_t val = 0;
+    int i;
+    for (i = 0; i < 4; i++)
+        val = (val << 8) | spi_byte(0xff);
+    return val;
+}
+
+// Wait for the card to return a byte other than 'skip'
+static uint8_t
+sd_wait(uint8_t skip)
+{
+    uint32_t end = timer_read_time() + timer_from_us(SD_TIMEOUT_US);
+    for (;;) {
+        uint8_t val = spi_byte(0xff);
+        if (val != skip || timer_is_before(end, timer_read_time()))
+            return val;
+    }
+}
+
+static void
+sd_deselect(void)
+{
+    gpio_out_write(cs, 1);
+    spi_byte(0xff);
+}
+
+// Check the card detect switch (if one is configured)
+static int
+sd_card_present(void)
+{
+    if (sdcard_detect_gpio < 0)
+        return 1;
+    struct gpio_in detect = gpio_in_setup(sdcard_detect_gpio
+                                          , sdcard_detect_pullup);
+    udelay(10);
+    return gpio_in_read(detect) == sdcard_detect_high;
+}
+
+// Place the card in SPI mode and wait for it to become ready
+static int
+sd_init(void)
+{
+    sck = gpio_out_setup(sdcard_gpio[0], 0);
+    mosi = gpio_out_setup(sdcard_gpio[1], 1);
+    miso = gpio_in_setup(sdcard_gpio[2], 1);
+    cs = gpio_out_setup(sdcard_gpio[3], 1);
+    spi_slow = 1;
+    int i;
+    for (i = 0; i < 10; i++)
+        spi_byte(0xff);
+
+    int ret = -1;
+    gpio_out_write(cs, 0);
+    if (sd_command(0, 0) != 0x01)
+        // No card present
+        goto done;
+    uint32_t hcs = 0;
+    if (sd_command(8, 0x1aa) == 0x01) {
+        if ((sd_read_word() & 0xfff) != 0x1aa)
+            goto done;
+        hcs = 1 << 30;
+    }
+    uint32_t end = timer_read_time() + timer_from_us(SD_TIMEOUT_US * 2);
+    for (;;) {
+        sd_command(55, 0);
+        uint8_t r1 = sd_command(41, hcs);
+        if (!r1)
+            break;
+        if (r1 != 0x01 || timer_is_before(end, timer_read_time()))
+            goto done;
+    }
+    if (hcs) {
+        if (sd_command(58, 0))
+            goto done;
+        block_addressing = !!(sd_read_word() & (1 << 30));
+    }
+    if (!block_addressing && sd_command(16, SECTOR_SIZE))
+        goto done;
+    spi_slow = 0;
+    ret = 0;
+done:
+    sd_deselect();
+    return ret;
+}
+
+// Read a sector into the sector buffer
+static int
+sd_read(uint32_t lba)
+{
+    int ret = -1;
+    gpio_out_write(cs, 0);
+    if (sd_command(17, block_addressing ? lba : lba * SECTOR_SIZE))
+        goto done;
+    if (sd_wait(0xff) != 0xfe)
+        goto done;
+    uint8_t *p = (void*)sector;
+    int i;
+    for (i = 0; i < SECTOR_SIZE; i++)
+        p[i] = spi_byte(0xff);
+    // Discard crc
+    spi_byte(0xff);
+    spi_byte(0xff);
+    ret = 0;
+done:
+    sd_deselect();
+    return ret;
+}
+
+// Write the sector buffer to the card
+static int
+sd_write(uint32_t lba)
+{
+    int ret = -1;
+    gpio_out_write(cs, 0);
+    if (sd_command(24, block_addressing ? lba : lba * SECTOR_SIZE))
+        goto done;
+    spi_byte(0xff);
+    spi_byte(0xfe);
+    uint8_t *p = (void*)sector;
+    int i;
+    for (i = 0; i < SECTOR_SIZE; i++)
+        spi_byte(p[i]);
+    spi_byte(0xff);
+    spi_byte(0xff);
+    if ((spi_byte(0xff) & 0x1f) != 0x05)
+        goto done;
+    if (sd_wait(0x00) == 0x00)
+        // Card still busy
+        goto done;
+    ret = 0;
+done:
+    sd_deselect();
+    return ret;
+}
+
+
+/****************************************************************
+ * FAT filesystem (read only, apart from marking the file installed)
+ ****************************************************************/
+
+static struct {
+    uint32_t fat_start, fat_size, root_start, root_sectors, data_start;
+    uint32_t root_cluster;
+    uint8_t sectors_per_cluster, num_fats, fat32;
+} fs;
+
+#define FAT_END 0x0ffffff8
+
+static uint16_t
+get_le16(uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t
+get_le32(uint8_t *p)
+{
+    return get_le16(p) | (get_le16(&p[2]) << 16);
+}
+
+// Locate the filesystem on the card
+static int
+fat_mount(void)
+{
+    uint8_t *p = (void*)sector;
+    if (sd_read(0) || get_le16(&p[510]) != 0xaa55)
+        return -1;
+    uint32_t part_start = 0;
+    if (p[0] != 0xeb && p[0] != 0xe9) {
+        // Master boot record - use the first partition
+        part_start = get_le32(&p[0x1c6]);
+        if (sd_read(part_start) || get_le16(&p[510]) != 0xaa55)
+            return -1;
+    }
+    if (get_le16(&p[11]) != SECTOR_SIZE || !p[13])
+        return -1;
+    uint32_t reserved = get_le16(&p[14]), num_fats = p[16];
+    uint32_t root_entries = get_le16(&p[17]);
+    uint32_t fat_size = get_le16(&p[22]);
+    if (!fat_size)
+        fat_size = get_le32(&p[36]);
+    fs.sectors_per_cluster = p[13];
+    fs.num_fats = num_fats;
+    fs.fat_size = fat_size;
+    fs.fat32 = !root_entries;
+    fs.root_cluster = fs.fat32 ? get_le32(&p[44]) : 0;
+    fs.fat_start = part_start + reserved;
+    fs.root_start = fs.fat_start + num_fats * fat_size;
+    fs.root_sectors = DIV_ROUND_UP(root_entries * 32, SECTOR_SIZE);
+    fs.data_start = fs.root_start + fs.root_sectors;
+    return 0;
+}
+
+static uint32_t
+cluster_to_lba(uint32_t cluster)
+{
+    return fs.data_start + (cluster - 2) * fs.sectors_per_cluster;
+}
+
+// Look up the cluster following 'cluster' in the allocation table
+static uint32_t
+fat_next_cluster(uint32_t cluster)
+{
+    uint32_t width = fs.fat32 ? 4 : 2, offset = cluster * width;
+    if (sd_read(fs.fat_start + offset / SECTOR_SIZE))
+        return FAT_END;
+    uint8_t *p = (uint8_t*)sector + offset % SECTOR_SIZE;
+    if (!fs.fat32) {
+        uint32_t next = get_le16(p);
+        return next >= 0xfff8 ? FAT_END : next;
+    }
+    return get_le32(p) & 0x0fffffff;
+}
+
+// Convert a file name to the padded 8.3 directory entry format
+static void
+fat_name(uint8_t *dest, const char *src)
+{
+    memset(dest, ' ', 11);
+    int i = 0;
+    for (; *src && *src != '.'; src++)
+        if (i < 8)
+            dest[i++] = *src;
+    if (*src == '.')
+        src++;
+    for (i = 8; *src && i < 11; src++)
+        dest[i++] = *src;
+    for (i = 0; i < 11; i++)
+        if (dest[i] >= 'a' && dest[i] <= 'z')
+            dest[i] -= 'a' - 'A';
+}
+
+struct fat_file {
+    uint32_t cluster, size, entry_lba, entry_offset;
+};
+
+// Search the root directory for a file
+static int
+fat_find(const uint8_t *name, struct fat_file *file)
+{
+    uint32_t cluster = fs.root_cluster;
+    uint32_t lba = fs.fat32 ? cluster_to_lba(cluster) : fs.root_start;
+    uint32_t count = fs.fat32 ? fs.sectors_per_cluster : fs.root_sectors;
+    for (;;) {
+        uint32_t i;
+        for (i = 0; i < count; i++) {
+            if (sd_read(lba + i))
+                return -1;
+            uint8_t *p = (void*)sector;
+            uint32_t off;
+            for (off = 0; off < SECTOR_SIZE; off += 32) {
+                if (!p[off])
+                    // End of directory
+                    return -1;
+                if (p[off + 11] & 0x18 || memcmp(&p[off], name, 11))
+                    // Volume label, sub-directory, or other file
+                    continue;
+                file->cluster = get_le16(&p[off + 26]);
+                if (fs.fat32)
+                    file->cluster |= get_le16(&p[off + 20]) << 16;
+                file->size = get_le32(&p[off + 28]);
+                file->entry_lba = lba + i;
+                file->entry_offset = off;
+                return 0;
+            }
+        }
+        if (!fs.fat32)
+            return -1;
+        cluster = fat_next_cluster(cluster);
+        if (cluster < 2 || cluster >= FAT_END)
+            return -1;
+        lba = cluster_to_lba(cluster);
+    }
+}
+
+
+/****************************************************************
+ * Firmware install
+ ****************************************************************/
+
+#define APP_AREA_SIZE (CONFIG_FLASH_START + CONFIG_FLASH_SIZE \
+                       - CONFIG_LAUNCH_APP_ADDRESS)
+
+// Walk the clusters of a file, either comparing it with or writing it
+// to the application area.  Returns 1 if the file differs (compare only).
+static int
+process_file(struct fat_file *file, int do_write)
+{
+    uint32_t cluster = file->cluster, offset = 0;
+    while (offset < file->size) {
+        if (cluster < 2 || cluster >= FAT_END)
+            return -1;
+        uint32_t lba = cluster_to_lba(cluster), i;
+        for (i = 0; i < fs.sectors_per_cluster && offset < file->size; i++) {
+            if (sd_read(lba + i))
+                return -1;
+            uint32_t count = file->size - offset;
+            if (count < SECTOR_SIZE)
+                memset((void*)sector + count, 0xff, SECTOR_SIZE - count);
+            void *app = (void*)CONFIG_LAUNCH_APP_ADDRESS + offset;
+            if (!do_write) {
+                if (memcmp(sector, app, SECTOR_SIZE))
+                    return 1;
+                offset += SECTOR_SIZE;
+                continue;
+            }
+            uint32_t pos;
+            for (pos = 0; pos < SECTOR_SIZE; pos += CONFIG_BLOCK_SIZE) {
+                int ret = flash_write_block(
+                    CONFIG_LAUNCH_APP_ADDRESS + offset + pos, &sector[pos / 4]);
+                if (ret < 0)
+                    return ret;
+            }
+            offset += SECTOR_SIZE;
+        }
+        cluster = fat_next_cluster(cluster);
+    }
+    return 0;
+}
+
+// Release the clusters of a deleted file in every copy of the FAT
+static int
+fat_free_chain(struct fat_file *file)
+{
+    uint32_t cluster = file->cluster, width = fs.fat32 ? 4 : 2;
+    uint32_t cluster_size = fs.sectors_per_cluster * SECTOR_SIZE;
+    uint32_t count = DIV_ROUND_UP(file->size, cluster_size);
+    while (count-- && cluster >= 2 && cluster < FAT_END) {
+        uint32_t offset = cluster * width, i;
+        if (sd_read(fs.fat_start + offset / SECTOR_SIZE))
+            return -1;
+        uint8_t *p = (uint8_t*)sector + offset % SECTOR_SIZE;
+        if (fs.fat32) {
+            cluster = get_le32(p) & 0x0fffffff;
+            // The upper 4 bits of a FAT32 entry are reserved
+            p[2] = 0;
+            p[3] &= 0xf0;
+        } else {
+            cluster = get_le16(p);
+            if (cluster >= 0xfff8)
+                cluster = FAT_END;
+        }
+        p[0] = p[1] = 0;
+        for (i = 0; i < fs.num_fats; i++)
+            if (sd_write(fs.fat_start + i * fs.fat_size
+                         + offset / SECTOR_SIZE))
+                return -1;
+    }
+    return 0;
+}
+
+// Delete a file from the root directory
+static int
+fat_delete(struct fat_file *file)
+{
+    if (sd_read(file->entry_lba))
+        return -1;
+    ((uint8_t*)sector)[file->entry_offset] = 0xe5;
+    if (sd_write(file->entry_lba))
+        return -1;
+    return fat_free_chain(file);
+}
+
+// Mark the firmware file as installed by changing its extension.  A
+// previously installed file is replaced.
+static int
+rename_file(struct fat_file *file, const uint8_t *name)
+{
+    uint8_t newname[11];
+    memcpy(newname, name, 8);
+    memcpy(&newname[8], "CUR", 3);
+    struct fat_file old;
+    if (!fat_find(newname, &old) && fat_delete(&old))
+        return -1;
+    if (sd_read(file->entry_lba))
+        return -1;
+    memcpy((void*)sector + file->entry_offset, newname, 11);
+    return sd_write(file->entry_lba);
+}
+
+// Flash the firmware file from an SD card (if one is present)
+int
+sdcard_install(void)
+{
+    if (!sd_card_present() || sd_init() || fat_mount())
+        return 0;
+    uint8_t name[11];
+    fat_name(name, CONFIG_SDCARD_FILENAME);
+    struct fat_file file;
+    if (fat_find(name, &file) || !file.size || file.size > APP_AREA_SIZE)
+        return 0;
+    int ret = process_file(&file, 0);
+    if (ret < 0)
+        return 0;
+    if (ret) {
+        ret = process_file(&file, 1);
+        if (ret < 0)
+            return ret;
+        ret = flash_complete();
+        if (ret < 0)
+            return ret;
+        if (process_file(&file, 0))
+            // Application doesn't match the file
+            return -1;
+    }
+    // Mark the file as installed only once the application matches it.
+    // If this fails, the next boot finds the file already installed and
+    // retries the rename.
+    rename_file(&file, name);
+    return 1;
+}
@@ -0,0 +1,90 @@
+// Install application images staged in spare flash
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <string.h> // memcpy
+#include "autoconf.h" // CONFIG_STAGED_IMAGE_ADDRESS
+#include "board/flash.h" // flash_write_block
+#include "board/misc.h" // crc16_ccitt_update
+#include "bootentry.h" // staged_image_install
+
+#define STAGED_IMAGE_MAGIC 0x6d49744b // "KtIm"
+
+// Header written by the application in front of a staged image
+struct staged_header {
+    uint32_t magic;
+    uint32_t size;
+    uint32_t crc;
+    uint32_t reserved;
+};
+
+#define STAGED_DATA (CONFIG_STAGED_IMAGE_ADDRESS + sizeof(struct staged_header))
+#define FLASH_END (CONFIG_FLASH_START + CONFIG_FLASH_SIZE)
+
+#if (CONFIG_STAGED_IMAGE_ADDRESS <= CONFIG_LAUNCH_APP_ADDRESS \
+     || CONFIG_STAGED_IMAGE_ADDRESS >= FLASH_END)
+  #error STAGED_IMAGE_ADDRESS must be in flash above the application start
+#endif
+
+// Check if the staged image is intact and differs from the application
+static int
+check_staged_image(struct staged_header *hdr)
+{
+    if ((CONFIG_STAGED_IMAGE_ADDRESS
+         % flash_get_page_size(CONFIG_STAGED_IMAGE_ADDRESS))
+        || hdr->magic != STAGED_IMAGE_MAGIC)
+        return 0;
+    uint32_t size = hdr->size;
+    if (!size || size > CONFIG_STAGED_IMAGE_ADDRESS - CONFIG_LAUNCH_APP_ADDRESS
+        || size > FLASH_END - STAGED_DATA)
+        return 0;
+    void *image = (void*)STAGED_DATA;
+    if (memcmp(image, (void*)CONFIG_LAUNCH_APP_ADDRESS, size) == 0)
+        // Image already installed
+        return 0;
+    return crc16_ccitt_update(0xffff, image, size) == hdr->crc;
+}
+
+// Invalidate the staged image header (the page holding it is erased)
+static int
+clear_staged_header(void)
+{
+    uint32_t data[CONFIG_BLOCK_SIZE / 4];
+    memcpy(data, (void*)CONFIG_STAGED_IMAGE_ADDRESS, sizeof(data));
+    data[0] = 0;
+    int ret = flash_write_block(CONFIG_STAGED_IMAGE_ADDRESS, data);
+    if (ret < 0)
+        return ret;
+    return flash_complete();
+}
+
+// Copy a valid staged image into the application area
+int
+staged_image_install(void)
+{
+    struct staged_header *hdr = (void*)CONFIG_STAGED_IMAGE_ADDRESS;
+    if (!check_staged_image(hdr))
+        return 0;
+    uint32_t size = hdr->size, offset;
+    for (offset = 0; offset < size; offset += CONFIG_BLOCK_SIZE) {
+        uint32_t data[CONFIG_BLOCK_SIZE / 4];
+        memset(data, 0xff, sizeof(data));
+        uint32_t c = size - offset;
+        if (c > CONFIG_BLOCK_SIZE)
+            c = CONFIG_BLOCK_SIZE;
+        memcpy(data, (void*)STAGED_DATA + offset, c);
+        int ret = flash_write_block(CONFIG_LAUNCH_APP_ADDRESS + offset, data);
+        if (ret < 0)
+            return ret;
+    }
+    int ret = flash_complete();
+    if (ret < 0)
+        return ret;
+    if (memcmp((void*)CONFIG_LAUNCH_APP_ADDRESS, (void*)STAGED_DATA, size))
+        return -1;
+    // Don't reinstall the image over a later application update
+    ret = clear_staged_header();
+    return ret < 0 ? ret : 1;
+}
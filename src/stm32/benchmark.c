@@ -0,0 +1,474 @@
+// Micro-benchmarks of bootloader hot paths for use under QEMU
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <string.h> // memset
+#include "autoconf.h" // CONFIG_BLOCK_SIZE
+#include "board/armcm_boot.h" // armcm_main
+#include "board/misc.h" // crc16_ccitt
+#include "byteorder.h" // cpu_to_le32
+#include "command.h" // command_find_block
+#include "flash.h" // flash_write_block
+#include "generic/canbus.h" // canhw_send
+#include "generic/canserial.h" // canserial_process_data
+#include "generic/serial_irq.h" // serial_get_tx_byte
+#include "generic/usb_cdc.h" // usb_read_bulk_out
+#include "sched.h" // sched_check_wake
+
+// The benchmark image is run by scripts/benchmark.py with instruction
+// counting enabled.  The name of a benchmark and an iteration count
+// are passed on the semihosting command line.  The hardware is never
+// initialized, so the image runs on QEMU machines that don't model
+// the clock tree.
+
+
+/****************************************************************
+ * Semihosting
+ ****************************************************************/
+
+#define SYS_WRITE0 0x04
+#define SYS_GET_CMDLINE 0x15
+#define SYS_EXIT 0x18
+#define ADP_STOPPED_APPLICATION_EXIT 0x20026
+#define ADP_STOPPED_RUNTIME_ERROR 0x20023
+
+static uint32_t
+semihost(uint32_t op, void *arg)
+{
+    register uint32_t r0 asm("r0") = op;
+    register void *r1 asm("r1") = arg;
+    asm volatile("bkpt 0xab" : "+r"(r0) : "r"(r1) : "memory");
+    return r0;
+}
+
+static void
+semihost_puts(const char *str)
+{
+    semihost(SYS_WRITE0, (void*)str);
+}
+
+static void __noreturn
+semihost_exit(uint32_t reason)
+{
+    semihost(SYS_EXIT, (void*)reason);
+    for (;;)
+        ;
+}
+
+
+/****************************************************************
+ * Board stubs
+ ****************************************************************/
+
+void
+sched_wake_tasks(void)
+{
+}
+
+void
+sched_wake_task(struct task_wake *w)
+{
+    w->wake = 1;
+}
+
+uint8_t
+sched_check_wake(struct task_wake *w)
+{
+    uint8_t wake = w->wake;
+    w->wake = 0;
+    return wake;
+}
+
+uint32_t
+timer_read_time(void)
+{
+    return 0;
+}
+
+uint32_t
+timer_from_us(uint32_t us)
+{
+    return us * (CONFIG_CLOCK_FREQ / 1000000);
+}
+
+uint8_t
+timer_is_before(uint32_t time1, uint32_t time2)
+{
+    return (int32_t)(time1 - time2) < 0;
+}
+
+void
+bootloader_request(void)
+{
+}
+
+// The command handlers only acknowledge the command (flash can't be
+// written under QEMU), so the "_ack" benchmarks cover the transport,
+// decoding, dispatch and response encoding but not the flash commands.
+static void
+respond_ack(uint32_t cmd, uint32_t *data)
+{
+    uint32_t out[4];
+    out[2] = data[1];
+    command_respond_ack(cmd, out, ARRAY_SIZE(out));
+}
+
+void
+command_connect(uint32_t *data)
+{
+    respond_ack(CMD_CONNECT, data);
+}
+
+void
+command_write_block(uint32_t *data)
+{
+    respond_ack(CMD_RX_BLOCK, data);
+}
+
+void
+command_eof(uint32_t *data)
+{
+    respond_ack(CMD_RX_EOF, data);
+}
+
+void
+command_read_block(uint32_t *data)
+{
+    uint32_t out[CONFIG_BLOCK_SIZE / 4 + 2 + 2];
+    out[2] = data[1];
+    memset(&out[3], 0xff, CONFIG_BLOCK_SIZE);
+    command_respond_ack(CMD_REQ_BLOCK, out, ARRAY_SIZE(out));
+}
+
+void
+command_complete(uint32_t *data)
+{
+    respond_ack(CMD_COMPLETE, data);
+}
+
+void
+command_echo(uint32_t *data)
+{
+    respond_ack(CMD_ECHO, data);
+}
+
+void
+command_update_block(uint32_t *data)
+{
+    respond_ack(CMD_UPDATE_BLOCK, data);
+}
+
+void
+command_update_commit(uint32_t *data)
+{
+    respond_ack(CMD_UPDATE_COMMIT, data);
+}
+
+void
+command_swap_bank(uint32_t *data)
+{
+    respond_ack(CMD_SWAP_BANK, data);
+}
+
+void
+command_read_range(uint32_t *data)
+{
+    respond_ack(CMD_READ_RANGE, data);
+}
+
+// Serial hardware
+void
+serial_enable_tx_irq(void)
+{
+}
+
+// CAN hardware
+int
+canhw_send(struct canbus_msg *msg)
+{
+    return msg->dlc;
+}
+
+void
+canhw_set_filter(uint32_t id)
+{
+}
+
+// USB hardware
+static uint8_t *usb_rx_data;
+static uint32_t usb_rx_len;
+
+int_fast8_t
+usb_read_bulk_out(void *data, uint_fast8_t max_len)
+{
+    uint32_t len = usb_rx_len > max_len ? max_len : usb_rx_len;
+    if (!len)
+        return -1;
+    memcpy(data, usb_rx_data, len);
+    usb_rx_data += len;
+    usb_rx_len -= len;
+    return len;
+}
+
+int_fast8_t
+usb_send_bulk_in(void *data, uint_fast8_t len)
+{
+    return len;
+}
+
+int_fast8_t
+usb_read_ep0(void *data, uint_fast8_t max_len)
+{
+    return -1;
+}
+
+int_fast8_t
+usb_read_ep0_setup(void *data, uint_fast8_t max_len)
+{
+    return -1;
+}
+
+int_fast8_t
+usb_send_ep0(const void *data, uint_fast8_t len)
+{
+    return -1;
+}
+
+void
+usb_stall_ep0(void)
+{
+}
+
+void
+usb_set_address(uint_fast8_t addr)
+{
+}
+
+void
+usb_set_configure(void)
+{
+}
+
+struct usb_string_descriptor *
+usbserial_get_serialid(void)
+{
+    return NULL;
+}
+
+
+/****************************************************************
+ * Benchmarks
+ ****************************************************************/
+
+// A "send block" command frame, as the host sends while flashing
+#define FRAME_WORDS (1 + 1 + CONFIG_BLOCK_SIZE / 4 + 1)
+static uint32_t frame[FRAME_WORDS];
+
+static void
+build_frame(void)
+{
+    uint32_t count = FRAME_WORDS - 2;
+    frame[0] = cpu_to_le32(count << 24 | CMD_RX_BLOCK << 16 | 0x8801);
+    frame[1] = cpu_to_le32(CONFIG_LAUNCH_APP_ADDRESS);
+    for (int i = 2; i < FRAME_WORDS - 1; i++)
+        frame[i] = cpu_to_le32(i * 0x01010101);
+    uint16_t crc = crc16_ccitt((uint8_t*)frame + 2, count * 4 + 2);
+    frame[FRAME_WORDS - 1] = cpu_to_le32(0x0399 << 16 | crc);
+}
+
+static void
+bench_crc16(uint32_t iterations)
+{
+    while (iterations--)
+        crc16_ccitt((uint8_t*)frame + 2, sizeof(frame) - 6);
+}
+
+static void
+bench_find_block(uint32_t iterations)
+{
+    uint_fast8_t pop_count;
+    while (iterations--)
+        command_find_block((uint8_t*)frame, sizeof(frame), &pop_count);
+}
+
+// Response transmission is included in the cost of a dispatch
+void canserial_tx_task(void);
+void usb_bulk_in_task(void);
+
+static void
+drain_transmit(void)
+{
+    if (CONFIG_CANSERIAL) {
+        canserial_tx_task();
+    } else if (CONFIG_USBSERIAL) {
+        usb_bulk_in_task();
+    } else if (CONFIG_SERIAL) {
+        uint8_t data;
+        while (!serial_get_tx_byte(&data))
+            ;
+    }
+}
+
+static void
+bench_dispatch_ack(uint32_t iterations)
+{
+    while (iterations--) {
+        command_dispatch((uint8_t*)frame, sizeof(frame));
+        drain_transmit();
+    }
+}
+
+// Write a block that already holds the same data (as when the host
+// retransmits a block).  This runs the erase and retransmit checks of
+// the flash write path without programming flash.  The block is part
+// of the vector table of this image, which never starts a flash page.
+static void
+bench_rewrite_block(uint32_t iterations)
+{
+    uint32_t addr = CONFIG_FLASH_START + CONFIG_BLOCK_SIZE;
+    uint32_t data[CONFIG_BLOCK_SIZE / 4];
+    memcpy(data, (void*)addr, sizeof(data));
+    while (iterations--)
+        if (flash_write_block(addr, data) < 0)
+            semihost_exit(ADP_STOPPED_RUNTIME_ERROR);
+}
+
+// Receive a frame over CAN, process it, and transmit the response (the
+// frames are sent without ISO-TP framing)
+void canserial_rx_task(void);
+
+#define BENCH_NODEID 0x40
+
+// Assign a node id to the (all zero) uuid so responses are transmitted
+static void
+canserial_setup(void)
+{
+    // Admin "set node id" command
+    struct canbus_msg msg = {
+        .id = CANBUS_ID_ADMIN, .dlc = 8, .data = { 0x11, [7] = BENCH_NODEID },
+    };
+    canserial_process_data(&msg);
+    canserial_rx_task();
+}
+
+static void
+bench_canserial_ack(uint32_t iterations)
+{
+    if (!CONFIG_CANSERIAL)
+        return;
+    struct canbus_msg msg = { .id = (BENCH_NODEID << 1) + 0x100 };
+    while (iterations--) {
+        uint8_t *data = (uint8_t*)frame;
+        uint32_t remaining = sizeof(frame);
+        while (remaining) {
+            uint32_t len = remaining > 8 ? 8 : remaining;
+            msg.dlc = len;
+            memcpy(msg.data, data, len);
+            canserial_process_data(&msg);
+            data += len;
+            remaining -= len;
+        }
+        canserial_rx_task();
+        canserial_tx_task();
+    }
+}
+
+// Receive a frame over USB, process it, and transmit the response
+void usb_bulk_out_task(void);
+
+static void
+bench_usb_cdc_ack(uint32_t iterations)
+{
+    if (!CONFIG_USBSERIAL)
+        return;
+    while (iterations--) {
+        usb_rx_data = (uint8_t*)frame;
+        usb_rx_len = sizeof(frame);
+        while (usb_rx_len) {
+            usb_notify_bulk_out();
+            usb_bulk_out_task();
+        }
+        usb_bulk_in_task();
+    }
+}
+
+static const struct benchmark {
+    const char *name;
+    void (*func)(uint32_t iterations);
+    uint8_t enabled;
+} benchmarks[] = {
+    { "crc16", bench_crc16, 1 },
+    { "find_block", bench_find_block, 1 },
+    { "dispatch_ack", bench_dispatch_ack, 1 },
+    { "rewrite_block", bench_rewrite_block
+      , !CONFIG_ENABLE_FLASH_SKIP_UNCHANGED },
+    { "canserial_ack", bench_canserial_ack, CONFIG_CANSERIAL },
+    { "usb_cdc_ack", bench_usb_cdc_ack, CONFIG_USBSERIAL },
+};
+
+
+/****************************************************************
+ * Startup
+ ****************************************************************/
+
+// Return the next space separated word of a string
+static char *
+next_word(char **pos)
+{
+    char *p = *pos;
+    while (*p == ' ')
+        p++;
+    char *word = p;
+    while (*p && *p != ' ')
+        p++;
+    if (*p)
+        *p++ = '\0';
+    *pos = p;
+    return word;
+}
+
+static uint32_t
+parse_uint(const char *str)
+{
+    uint32_t val = 0;
+    while (*str >= '0' && *str <= '9')
+        val = val * 10 + *str++ - '0';
+    return val;
+}
+
+// Main entry point - called from armcm_boot.c:ResetHandler()
+void
+armcm_main(void)
+{
+    // Command line: <image> <benchmark|list> [iterations]
+    static char cmdline[80];
+    struct { char *buf; uint32_t len; } args = { cmdline, sizeof(cmdline) };
+    if (semihost(SYS_GET_CMDLINE, &args))
+        semihost_exit(ADP_STOPPED_RUNTIME_ERROR);
+    char *pos = cmdline;
+    next_word(&pos);
+    char *name = next_word(&pos);
+    uint32_t iterations = parse_uint(next_word(&pos));
+
+    build_frame();
+    if (CONFIG_CANSERIAL)
+        canserial_setup();
+    const struct benchmark *b;
+    for (b = benchmarks; b < &benchmarks[ARRAY_SIZE(benchmarks)]; b++) {
+        if (!b->enabled)
+            continue;
+        if (strcmp(name, "list") == 0) {
+            semihost_puts(b->name);
+            semihost_puts("\n");
+        } else if (strcmp(name, b->name) == 0) {
+            b->func(iterations);
+            semihost_exit(ADP_STOPPED_APPLICATION_EXIT);
+        }
+    }
+    if (strcmp(name, "list") == 0)
+        semihost_exit(ADP_STOPPED_APPLICATION_EXIT);
+    semihost_puts("Unknown benchmark\n");
+    semihost_exit(ADP_STOPPED_RUNTIME_ERROR);
+}
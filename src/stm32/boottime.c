@@ -0,0 +1,92 @@
+// Record boot phase timestamps in the stm32 backup registers
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "autoconf.h" // CONFIG_CLOCK_FREQ
+#include "canboot.h" // boot_timestamp_record
+#include "internal.h" // DWT
+
+// The record is kept in the last six backup registers, which are only
+// cleared on a backup domain reset, so the application's use of ram
+// can't overwrite it.  The backup domain is write protected outside
+// of the updates below.
+#if CONFIG_MACH_STM32G4
+#define BOOT_TIMESTAMPS ((volatile struct boot_timestamps *)&TAMP->BKP10R)
+#elif CONFIG_MACH_STM32H7
+#define BOOT_TIMESTAMPS ((volatile struct boot_timestamps *)&RTC->BKP26R)
+#else
+#define BOOT_TIMESTAMPS ((volatile struct boot_timestamps *)&RTC->BKP14R)
+#endif
+
+// Allow writes to the backup registers
+static void
+backup_unlock(void)
+{
+#if CONFIG_MACH_STM32G4
+    RCC->APB1ENR1 |= RCC_APB1ENR1_PWREN | RCC_APB1ENR1_RTCAPBEN;
+    RCC->APB1ENR1;
+    PWR->CR1 |= PWR_CR1_DBP;
+#elif CONFIG_MACH_STM32H7
+    RCC->APB4ENR |= RCC_APB4ENR_RTCAPBEN;
+    RCC->APB4ENR;
+    PWR->CR1 |= PWR_CR1_DBP;
+#else
+    RCC->APB1ENR |= RCC_APB1ENR_PWREN;
+    RCC->APB1ENR;
+    PWR->CR |= PWR_CR_DBP;
+#endif
+}
+
+static void
+backup_lock(void)
+{
+#if CONFIG_MACH_STM32G4 || CONFIG_MACH_STM32H7
+    PWR->CR1 &= ~PWR_CR1_DBP;
+#else
+    PWR->CR &= ~PWR_CR_DBP;
+#endif
+}
+
+// Start the cycle counter from zero (called early in a fresh bootup).
+// The DWT is only reset on power up, so the count continues through
+// the reset that starts the application.
+void
+boot_timestamps_start(void)
+{
+    backup_unlock();
+    volatile struct boot_timestamps *bt = BOOT_TIMESTAMPS;
+    bt->signature = BOOT_TIMESTAMPS_SIGNATURE;
+    bt->clock_freq = CONFIG_CLOCK_FREQ;
+    bt->reset_cause = 0;
+    for (int i = 0; i < BOOT_PHASE_COUNT; i++)
+        bt->phase_cycles[i] = 0;
+    backup_lock();
+
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+#if __CORTEX_M == 7
+    DWT->LAR = 0xC5ACCE55;
+#endif
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+// Note the completion of a bootup phase
+void
+boot_timestamp_record(int phase)
+{
+    uint32_t cycles = DWT->CYCCNT;
+    backup_unlock();
+    BOOT_TIMESTAMPS->phase_cycles[phase] = cycles;
+    backup_lock();
+}
+
+// Store the reset cause flags
+void
+boot_timestamps_set_reset_cause(uint32_t cause)
+{
+    backup_unlock();
+    BOOT_TIMESTAMPS->reset_cause = cause;
+    backup_lock();
+}
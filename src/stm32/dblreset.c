@@ -0,0 +1,79 @@
+// stm32 specific handling for checking if double reset occurred
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "autoconf.h" // CONFIG_MACH_STM32H7
+#include "bootentry.h" // board_check_double_reset
+#include "canboot.h" // udelay
+#include "internal.h" // RCC
+#include "sched.h" // DECL_INIT
+
+#define DOUBLE_CLICK_MIN_US 10000
+#define DOUBLE_CLICK_MAX_US 500000
+
+// The reset flags accumulate until cleared with the RMVF bit.  The
+// pin flag is set on every reset, as the reset is driven out on NRST.
+// The h7 also sets the cpu flag on every reset.
+#if CONFIG_MACH_STM32H7
+#define RESET_REG RCC->RSR
+#define RESET_FLAGS_MASK 0xfffe0000
+#define RESET_RMVF RCC_RSR_RMVF
+#define RESET_PIN RCC_RSR_PINRSTF
+#define RESET_BUTTON_FLAGS (RCC_RSR_PINRSTF | RCC_RSR_CPURSTF)
+#else
+#define RESET_REG RCC->CSR
+#define RESET_FLAGS_MASK 0xfe000000
+#define RESET_RMVF RCC_CSR_RMVF
+#define RESET_PIN RCC_CSR_PINRSTF
+#define RESET_BUTTON_FLAGS RCC_CSR_PINRSTF
+#endif
+
+// Read and clear the reset flags
+static uint32_t
+reset_flags_consume(void)
+{
+    uint32_t flags = RESET_REG & RESET_FLAGS_MASK;
+    RESET_REG |= RESET_RMVF;
+    return flags;
+}
+
+int
+board_check_double_reset(void)
+{
+    uint32_t flags = reset_flags_consume();
+    if (CONFIG_ENABLE_BOOT_TIMESTAMPS)
+        boot_timestamps_set_reset_cause(flags);
+    // Only a press of the reset button can start a double click.
+    // Power on, brown out, watchdog, and software resets (such as a
+    // restart requested by the application) start the application
+    // without delay.
+    if (!(flags & RESET_PIN) || flags & ~RESET_BUTTON_FLAGS)
+        return 0;
+    // Initial delay (reset in under 10ms isn't a "double tap")
+    udelay(DOUBLE_CLICK_MIN_US);
+    // Set request signature - entered if reset is clicked again
+    set_bootup_code(REQUEST_CANBOOT);
+    udelay(DOUBLE_CLICK_MAX_US - DOUBLE_CLICK_MIN_US);
+    // No reset, clear the bootup code
+    set_bootup_code(0);
+    return 0;
+}
+
+// Clear the flags of the software reset used by the bootloader to
+// start the application, so that they are not mistaken for a later
+// reset
+void
+board_reset_flags_clear(void)
+{
+    RESET_REG |= RESET_RMVF;
+}
+
+// Clear stale reset flags when remaining in the bootloader
+void
+dblreset_init(void)
+{
+    reset_flags_consume();
+}
+DECL_INIT(dblreset_init);
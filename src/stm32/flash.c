@@ -7,11 +7,14 @@
 #include <string.h> // memset
 #include "autoconf.h" // CONFIG_MACH_STM32F103
 #include "board/io.h" // writew
+#include "board/irq.h" // irq_disable
+#include "canboot.h" // flash_bank_commit
+#include "compiler.h" // __always_inline
 #include "flash.h" // flash_write_block
 #include "internal.h" // FLASH
 
 // Return the flash page size at the given address
-static uint32_t
+uint32_t
 flash_get_page_size(uint32_t addr)
 {
     if (CONFIG_MACH_STM32F2 || CONFIG_MACH_STM32F4) {
@@ -59,11 +62,27 @@ check_erased(uint32_t addr, uint32_t count)
 #define KEYR KEYR1
 #endif
 
+#if CONFIG_MACH_STM32H7 && CONFIG_ENABLE_FLASH_BANK_SWAP
+// The bank 2 registers are located 0x100 bytes after the bank 1 registers
+static uint32_t flash_bank_offset;
+#define FLASH_BANK ((FLASH_TypeDef*)((uint32_t)FLASH + flash_bank_offset))
+#else
+#define FLASH_BANK FLASH
+#endif
+
+// The low-level helpers must be inlined into the ram resident
+// bootloader update code, as flash is not readable while it is erased
+#if CONFIG_ENABLE_BOOTLOADER_UPDATE
+#define __flashfunc __always_inline
+#else
+#define __flashfunc
+#endif
+
 // Wait for flash hardware to report ready
-static void
+static void __flashfunc
 wait_flash(void)
 {
-    while (FLASH->SR & FLASH_SR_BSY)
+    while (FLASH_BANK->SR & FLASH_SR_BSY)
         ;
 }
 
@@ -73,26 +92,26 @@ wait_flash(void)
 #endif
 
 // Issue low-level flash hardware unlock sequence
-static void
+static void __flashfunc
 unlock_flash(void)
 {
-    if (FLASH->CR & FLASH_CR_LOCK) {
+    if (FLASH_BANK->CR & FLASH_CR_LOCK) {
         // Unlock Flash Erase
-        FLASH->KEYR = FLASH_KEY1;
-        FLASH->KEYR = FLASH_KEY2;
+        FLASH_BANK->KEYR = FLASH_KEY1;
+        FLASH_BANK->KEYR = FLASH_KEY2;
     }
     wait_flash();
 }
 
 // Place low-level flash hardware into a locked state
-static void
+static void __flashfunc
 lock_flash(void)
 {
-    FLASH->CR = FLASH_CR_LOCK;
+    FLASH_BANK->CR = FLASH_CR_LOCK;
 }
 
 // Issue a low-level flash hardware erase request for a flash page
-static void
+static void __flashfunc
 erase_page(uint32_t page_address)
 {
 #if CONFIG_MACH_STM32F2 || CONFIG_MACH_STM32F4
@@ -123,9 +142,15 @@ erase_page(uint32_t page_address)
     FLASH->CR = FLASH_CR_PER | FLASH_CR_STRT | (pidx << FLASH_CR_PNB_Pos);
 #elif CONFIG_MACH_STM32H7
     uint32_t snb = (page_address - 0x08000000) / (128 * 1024);
+    if (CONFIG_ENABLE_FLASH_BANK_SWAP)
+        // Sector numbers are relative to the selected bank.  This
+        // assumes the bank registers follow the memory map once the
+        // banks are swapped, see inactive_bank_address().
+        snb &= 7;
     snb = snb > 7 ? 7 : snb;
-    FLASH->CR = FLASH_CR_SER | FLASH_CR_START | (snb << FLASH_CR_SNB_Pos);
-    while (FLASH->SR & FLASH_SR_QW)
+    FLASH_BANK->CR = (FLASH_CR_SER | FLASH_CR_START
+                      | (snb << FLASH_CR_SNB_Pos));
+    while (FLASH_BANK->SR & FLASH_SR_QW)
         ;
     SCB_InvalidateDCache_by_Addr((void*)page_address, 128*1024);
 #endif
@@ -133,7 +158,7 @@ erase_page(uint32_t page_address)
 }
 
 // Write out a "block" of data to the low-level flash hardware
-static void
+static void __flashfunc
 write_block(uint32_t block_address, uint32_t *data)
 {
 #if CONFIG_MACH_STM32F2 || CONFIG_MACH_STM32F4
@@ -160,7 +185,7 @@ write_block(uint32_t block_address, uint32_t *data)
     }
 #elif CONFIG_MACH_STM32H7
     uint32_t *page = (void*)block_address;
-    FLASH->CR = FLASH_CR_PG;
+    FLASH_BANK->CR = FLASH_CR_PG;
     for (int i = 0; i < CONFIG_BLOCK_SIZE / 32; i++) {
         writel(&page[i*8], data[i*8]);
         writel(&page[i*8 + 1], data[i*8 + 1]);
@@ -170,7 +195,7 @@ write_block(uint32_t block_address, uint32_t *data)
         writel(&page[i*8 + 5], data[i*8 + 5]);
         writel(&page[i*8 + 6], data[i*8 + 6]);
         writel(&page[i*8 + 7], data[i*8 + 7]);
-        while (FLASH->SR & FLASH_SR_QW)
+        while (FLASH_BANK->SR & FLASH_SR_QW)
             ;
         wait_flash();
     }
@@ -178,15 +203,25 @@ write_block(uint32_t block_address, uint32_t *data)
 #endif
 }
 
+// Select the register bank used to program the given address
+static void
+select_bank(uint32_t addr)
+{
+#if CONFIG_MACH_STM32H7 && CONFIG_ENABLE_FLASH_BANK_SWAP
+    flash_bank_offset = addr >= FLASH_BANK2_BASE ? 0x100 : 0;
+#endif
+}
+
 static uint32_t page_write_count;
 
-// Main block write interface
-int
-flash_write_block(uint32_t block_address, uint32_t *data)
+// Erase (if needed) and write a block of flash
+static int
+write_flash_block(uint32_t block_address, uint32_t *data)
 {
     if (block_address & (CONFIG_BLOCK_SIZE - 1))
         // Not a block aligned address
         return -1;
+    select_bank(block_address);
     uint32_t flash_page_size = flash_get_page_size(block_address);
     uint32_t page_address = ALIGN_DOWN(block_address, flash_page_size);
 
@@ -226,6 +261,12 @@ flash_write_block(uint32_t block_address, uint32_t *data)
             lock_flash();
             unlock_flash();
         }
+        if (CONFIG_ENABLE_FLASH_BANK_SWAP
+            && !check_erased(page_address, flash_page_size)) {
+            // The erase did not reach the addressed page
+            lock_flash();
+            return -4;
+        }
     }
     // Write block
     write_block(block_address, data);
@@ -239,9 +280,333 @@ flash_write_block(uint32_t block_address, uint32_t *data)
     return 0;
 }
 
+
+/****************************************************************
+ * Flash bank swapping
+ ****************************************************************/
+
+#if CONFIG_ENABLE_FLASH_BANK_SWAP
+
+#ifndef FLASH_OPTKEY1
+#define FLASH_OPTKEY1 (0x08192A3BUL)
+#define FLASH_OPTKEY2 (0x4C5D6E7FUL)
+#endif
+
+static uint8_t bank_staged, bank_swap_pending;
+
+// Return the size of each flash bank (or zero if flash has one bank)
+static uint32_t
+flash_bank_size(void)
+{
+#if CONFIG_MACH_STM32G0
+    if (!(FLASH->OPTR & FLASH_OPTR_DUAL_BANK))
+        return 0;
+    uint16_t *flash_size = (void*)FLASHSIZE_BASE;
+    return *flash_size * 1024 / 2;
+#else
+    return FLASH_BANK_SIZE;
+#endif
+}
+
+// Translate an application address to its location in the inactive bank.
+// Addresses refer to the current memory map, so the inactive bank is the
+// upper half whichever physical bank is mapped there.  The page (G0) and
+// sector (H7) numbers used to erase are derived from these addresses,
+// which assumes the erase registers follow the memory map when the banks
+// are swapped.  Every erase is checked, so a mismatch fails the flash
+// instead of writing to a page that was not erased.
+static uint32_t
+inactive_bank_address(uint32_t addr)
+{
+    uint32_t bank_size = flash_bank_size();
+    if (!bank_size)
+        return addr;
+    if (addr >= CONFIG_FLASH_START + bank_size)
+        // Application does not fit in a single bank
+        return 0;
+    return addr + bank_size;
+}
+
+// Copy the running bootloader to the inactive bank
+static int
+mirror_bootloader(void)
+{
+    uint32_t bank_size = flash_bank_size();
+    if (!bank_size)
+        return -1;
+    void *fstart = (void*)CONFIG_FLASH_START;
+    uint32_t size = CONFIG_LAUNCH_APP_ADDRESS - CONFIG_FLASH_START;
+    if (memcmp(fstart, fstart + bank_size, size) == 0)
+        return 0;
+    uint32_t count = page_write_count, addr;
+    for (addr = CONFIG_FLASH_START; addr < CONFIG_LAUNCH_APP_ADDRESS
+         ; addr += CONFIG_BLOCK_SIZE) {
+        int ret = write_flash_block(addr + bank_size, (void*)addr);
+        if (ret < 0)
+            return ret;
+    }
+    page_write_count = count;
+    return 0;
+}
+
+// Return the address to read when verifying an application
+uint32_t
+flash_bank_read_address(uint32_t address)
+{
+    if (!bank_staged || address < CONFIG_LAUNCH_APP_ADDRESS)
+        return address;
+    uint32_t inactive = inactive_bank_address(address);
+    return inactive ? inactive : address;
+}
+
+// Arrange to boot the application in the inactive bank
+int
+flash_bank_request_swap(void)
+{
+    uint32_t bank_size = flash_bank_size();
+    if (!bank_size)
+        return -1;
+    uint32_t *app = (void*)CONFIG_LAUNCH_APP_ADDRESS + bank_size;
+    if (*app == 0 || *app == 0xffffffff)
+        return -1;
+    int ret = mirror_bootloader();
+    if (ret < 0)
+        return ret;
+    bank_swap_pending = 1;
+    return 0;
+}
+
+// Keep booting the running bank
+void
+flash_bank_cancel_swap(void)
+{
+    bank_swap_pending = 0;
+}
+
+// Swap the flash banks and reset if a swap has been requested
+void
+flash_bank_commit(void)
+{
+    if (!bank_swap_pending)
+        return;
+    irq_disable();
+    select_bank(CONFIG_FLASH_START);
+    unlock_flash();
+    FLASH->OPTKEYR = FLASH_OPTKEY1;
+    FLASH->OPTKEYR = FLASH_OPTKEY2;
+#if CONFIG_MACH_STM32G0
+    FLASH->OPTR ^= FLASH_OPTR_nSWAP_BANK;
+    FLASH->CR = FLASH_CR_OPTSTRT;
+    wait_flash();
+    // Reloading the option bytes resets the chip
+    FLASH->CR = FLASH_CR_OBL_LAUNCH;
+#elif CONFIG_MACH_STM32H7
+    if (FLASH->OPTCR & FLASH_OPTCR_SWAP_BANK)
+        FLASH->OPTSR_PRG &= ~FLASH_OPTSR_SWAP_BANK_OPT;
+    else
+        FLASH->OPTSR_PRG |= FLASH_OPTSR_SWAP_BANK_OPT;
+    FLASH->OPTCR |= FLASH_OPTCR_OPTSTART;
+    while (FLASH->OPTSR_CUR & FLASH_OPTSR_OPT_BUSY)
+        ;
+#endif
+    NVIC_SystemReset();
+}
+
+#endif
+
+
+/****************************************************************
+ * Unchanged page skipping
+ ****************************************************************/
+
+#if CONFIG_ENABLE_FLASH_SKIP_UNCHANGED
+
+// Incoming blocks are collected into a full page, which is only erased
+// and programmed if it differs from the current flash contents
+// Sized for the flash pages of the configured chip (larger pages
+// are written without buffering)
+#if CONFIG_MACH_STM32F031 || CONFIG_MACH_STM32F042
+#define PAGE_BUF_SIZE 1024
+#elif CONFIG_MACH_STM32F103 && CONFIG_FLASH_SIZE < 0x40000
+#define PAGE_BUF_SIZE 1024
+#else
+#define PAGE_BUF_SIZE 2048
+#endif
+
+static uint32_t page_buf[PAGE_BUF_SIZE / 4];
+static uint32_t page_buf_address, page_buf_count, page_skip_count;
+
+// Write the buffered page to flash if it differs from the flash contents
+static int
+flush_page_buffer(void)
+{
+    uint32_t count = page_buf_count;
+    if (!count)
+        return 0;
+    page_buf_count = 0;
+    uint32_t page_size = flash_get_page_size(page_buf_address);
+    if (memcmp(page_buf, (void*)page_buf_address, page_size) == 0) {
+        page_skip_count++;
+        return 0;
+    }
+    uint32_t offset;
+    for (offset = 0; offset < count; offset += CONFIG_BLOCK_SIZE) {
+        int ret = write_flash_block(page_buf_address + offset
+                                    , &page_buf[offset / 4]);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+// Add a block to the page buffer
+static int
+buffer_flash_block(uint32_t block_address, uint32_t *data)
+{
+    if (block_address & (CONFIG_BLOCK_SIZE - 1))
+        // Not a block aligned address
+        return -1;
+    uint32_t page_size = flash_get_page_size(block_address);
+    uint32_t page_address = ALIGN_DOWN(block_address, page_size);
+    if (page_buf_count && page_address != page_buf_address) {
+        int ret = flush_page_buffer();
+        if (ret < 0)
+            return ret;
+    }
+    if (!page_buf_count) {
+        if (block_address != page_address || page_size > PAGE_BUF_SIZE)
+            // Retransmit of an already written block (or page too large)
+            return write_flash_block(block_address, data);
+        page_buf_address = page_address;
+        memset(page_buf, 0xff, sizeof(page_buf));
+    }
+    uint32_t offset = block_address - page_address;
+    if (offset > page_buf_count)
+        // Out of order request
+        return -2;
+    memcpy(&page_buf[offset / 4], data, CONFIG_BLOCK_SIZE);
+    if (offset == page_buf_count)
+        page_buf_count += CONFIG_BLOCK_SIZE;
+    if (page_buf_count >= page_size)
+        return flush_page_buffer();
+    return 0;
+}
+
+// Return the number of pages not rewritten as they were unchanged
+uint32_t
+flash_get_skipped_pages(void)
+{
+    return page_skip_count;
+}
+
+#endif
+
+
+/****************************************************************
+ * Flash interface
+ ****************************************************************/
+
+// Main block write interface
+int
+flash_write_block(uint32_t block_address, uint32_t *data)
+{
+#if CONFIG_ENABLE_FLASH_BANK_SWAP
+    if (block_address >= CONFIG_LAUNCH_APP_ADDRESS) {
+        // Applications are written to the inactive bank
+        block_address = inactive_bank_address(block_address);
+        if (!block_address)
+            return -1;
+        bank_staged = 1;
+    }
+#endif
+#if CONFIG_ENABLE_FLASH_SKIP_UNCHANGED
+    return buffer_flash_block(block_address, data);
+#else
+    return write_flash_block(block_address, data);
+#endif
+}
+
 // Main flash complete notification interface
 int
 flash_complete(void)
 {
+#if CONFIG_ENABLE_FLASH_SKIP_UNCHANGED
+    int ret = flush_page_buffer();
+    if (ret < 0)
+        return ret;
+#endif
+#if CONFIG_ENABLE_FLASH_BANK_SWAP
+    if (bank_staged && flash_bank_size()) {
+        // The new application boots once the banks are swapped
+        int ret = mirror_bootloader();
+        if (ret < 0)
+            return ret;
+        bank_swap_pending = 1;
+    }
+#endif
+#if CONFIG_ENABLE_FLASH_SKIP_UNCHANGED
+    // Unchanged pages are included in the reported page count
+    return page_write_count + page_skip_count;
+#else
     return page_write_count;
+#endif
 }
+
+
+/****************************************************************
+ * Bootloader update
+ ****************************************************************/
+
+#if CONFIG_ENABLE_BOOTLOADER_UPDATE
+
+// Overwrite the bootloader with an image staged in ram and then
+// reset.  This code runs from ram and must not call into flash.
+static void __noreturn noinline __section(".ramfunc.write_bootloader")
+write_bootloader(uint32_t *image, uint32_t size, uint32_t page_size)
+{
+    uint32_t *fstart = (void*)CONFIG_FLASH_START, i;
+    for (;;) {
+        unlock_flash();
+        uint32_t addr;
+        for (addr = CONFIG_FLASH_START; addr < CONFIG_LAUNCH_APP_ADDRESS
+             ; addr += page_size) {
+            erase_page(addr);
+            // avoid triggering STM32H72xx write security
+            if (CONFIG_MACH_STM32H7) {
+                lock_flash();
+                unlock_flash();
+            }
+        }
+        for (i = 0; i < size / 4; i += CONFIG_BLOCK_SIZE / 4)
+            write_block(CONFIG_FLASH_START + i * 4, &image[i]);
+        lock_flash();
+
+        // Verify the new image - there is no way to recover from a
+        // failure here, so keep retrying until the write succeeds
+        for (i = 0; i < size / 4; i++)
+            if (fstart[i] != image[i])
+                break;
+        if (i >= size / 4)
+            break;
+    }
+
+    // Reset into the new bootloader
+    __DSB();
+    SCB->AIRCR = ((0x5FAUL << SCB_AIRCR_VECTKEY_Pos)
+                  | SCB_AIRCR_SYSRESETREQ_Msk);
+    __DSB();
+    for (;;)
+        ;
+}
+
+// Replace the bootloader with the given image (does not return)
+void
+flash_write_bootloader(uint32_t *image, uint32_t size)
+{
+    uint32_t page_size = flash_get_page_size(CONFIG_FLASH_START);
+    select_bank(CONFIG_FLASH_START);
+    irq_disable();
+    write_bootloader(image, size, page_size);
+}
+
+#endif
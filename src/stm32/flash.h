@@ -3,7 +3,9 @@
 
 #include <stdint.h>
 
+uint32_t flash_get_page_size(uint32_t addr);
 int flash_write_block(uint32_t block_address, uint32_t *data);
 int flash_complete(void);
+void flash_write_bootloader(uint32_t *image, uint32_t size);
 
 #endif
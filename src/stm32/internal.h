@@ -44,6 +44,14 @@ int is_enabled_pclock(uint32_t periph_base);
 void dfu_reboot(void);
 void dfu_reboot_check(void);
 
+// serial_dma.c
+void serial_dma_setup(uint32_t usart_base, volatile void *rx_reg
+                      , volatile void *usart_tx_reg);
+int serial_dma_rx_poll(void);
+uint32_t serial_dma_tx_pending(void);
+uint32_t serial_dma_tx_fill(void);
+void serial_dma_tx_start(uint32_t count);
+
 // stm32??.c
 struct cline { volatile uint32_t *en, *rst; uint32_t bit; };
 struct cline lookup_clock_line(uint32_t periph_base);
@@ -0,0 +1,291 @@
+// STM32 serial dma transfers
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "autoconf.h" // CONFIG_MACH_STM32F1
+#include "board/serial_irq.h" // serial_rx_byte
+#include "compiler.h" // __aligned
+#include "internal.h" // serial_dma_setup
+
+#if CONFIG_MACH_STM32F2 || CONFIG_MACH_STM32F4 || CONFIG_MACH_STM32H7
+  #define HAVE_DMA_STREAMS 1
+  typedef DMA_Stream_TypeDef dma_chan_t;
+#else
+  #define HAVE_DMA_STREAMS 0
+  typedef DMA_Channel_TypeDef dma_chan_t;
+#endif
+
+// The receive index wraps at 256 bytes, so the rx buffer size is fixed
+#define RX_BUF_SIZE 256
+#define TX_BUF_SIZE 128
+
+static uint8_t rx_buf[RX_BUF_SIZE] __aligned(32);
+static uint8_t tx_buf[TX_BUF_SIZE] __aligned(32);
+static uint8_t rx_pos;
+static dma_chan_t *rx_chan, *tx_chan;
+static uint32_t tx_cfg;
+static volatile void *tx_reg;
+
+
+/****************************************************************
+ * DMA channel routing
+ ****************************************************************/
+
+struct dma_route {
+    dma_chan_t *rx, *tx;
+    uint32_t rx_req, tx_req;
+};
+
+// Lookup the dma channels (and request lines) for a given usart
+static struct dma_route
+lookup_dma_route(uint32_t usart_base)
+{
+#if CONFIG_MACH_STM32F1
+    if (usart_base == USART1_BASE)
+        return (struct dma_route){ DMA1_Channel5, DMA1_Channel4 };
+    if (usart_base == USART2_BASE)
+        return (struct dma_route){ DMA1_Channel6, DMA1_Channel7 };
+    return (struct dma_route){ DMA1_Channel3, DMA1_Channel2 };
+#elif CONFIG_MACH_STM32F2 || CONFIG_MACH_STM32F4
+    // All usart requests use dma channel 4
+    if (usart_base == USART1_BASE)
+        return (struct dma_route){ DMA2_Stream2, DMA2_Stream7, 4, 4 };
+    if (usart_base == USART2_BASE)
+        return (struct dma_route){ DMA1_Stream5, DMA1_Stream6, 4, 4 };
+    return (struct dma_route){ DMA1_Stream1, DMA1_Stream3, 4, 4 };
+#elif CONFIG_MACH_STM32F0
+    if (usart_base == USART1_BASE)
+        return (struct dma_route){ DMA1_Channel3, DMA1_Channel2 };
+    return (struct dma_route){ DMA1_Channel5, DMA1_Channel4 };
+#elif CONFIG_MACH_STM32G0
+    // Requests are routed to the first two channels via the dmamux
+    if (usart_base == USART1_BASE)
+        return (struct dma_route){ DMA1_Channel1, DMA1_Channel2, 50, 51 };
+    if (usart_base == USART2_BASE)
+        return (struct dma_route){ DMA1_Channel1, DMA1_Channel2, 52, 53 };
+    return (struct dma_route){ DMA1_Channel1, DMA1_Channel2, 54, 55 };
+#elif CONFIG_MACH_STM32G4
+    if (usart_base == USART1_BASE)
+        return (struct dma_route){ DMA1_Channel1, DMA1_Channel2, 24, 25 };
+    if (usart_base == USART2_BASE)
+        return (struct dma_route){ DMA1_Channel1, DMA1_Channel2, 26, 27 };
+    return (struct dma_route){ DMA1_Channel1, DMA1_Channel2, 28, 29 };
+#elif CONFIG_MACH_STM32H7
+    if (usart_base == USART1_BASE)
+        return (struct dma_route){ DMA1_Stream0, DMA1_Stream1, 41, 42 };
+    if (usart_base == USART2_BASE)
+        return (struct dma_route){ DMA1_Stream0, DMA1_Stream1, 43, 44 };
+    if (usart_base == USART3_BASE)
+        return (struct dma_route){ DMA1_Stream0, DMA1_Stream1, 45, 46 };
+    return (struct dma_route){ DMA1_Stream0, DMA1_Stream1, 63, 64 };
+#endif
+}
+
+// Enable the clock of the dma controllers
+static void
+enable_dma_clock(void)
+{
+#if CONFIG_MACH_STM32F0 || CONFIG_MACH_STM32F1 || CONFIG_MACH_STM32G0
+    RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+#elif CONFIG_MACH_STM32F2 || CONFIG_MACH_STM32F4
+    RCC->AHB1ENR |= RCC_AHB1ENR_DMA1EN | RCC_AHB1ENR_DMA2EN;
+#elif CONFIG_MACH_STM32G4
+    RCC->AHB1ENR |= RCC_AHB1ENR_DMA1EN | RCC_AHB1ENR_DMAMUX1EN;
+#elif CONFIG_MACH_STM32H7
+    RCC->AHB1ENR |= RCC_AHB1ENR_DMA1EN;
+#endif
+}
+
+
+/****************************************************************
+ * DMA channel control
+ ****************************************************************/
+
+#define DMA_FLAG_HT 0x01
+#define DMA_FLAG_TC 0x02
+
+#if HAVE_DMA_STREAMS
+// Return the bit position of a stream's flags in the LISR/HISR registers
+static uint32_t
+dma_stream_flag_shift(dma_chan_t *chan)
+{
+    static const uint8_t flag_shift[] = { 0, 6, 16, 22 };
+    uint32_t snum = ((uint32_t)chan - ((uint32_t)chan & ~0xff) - 0x10) / 0x18;
+    return flag_shift[snum & 3];
+}
+
+// Return the flag clear register of a stream
+static volatile uint32_t *
+dma_stream_ifcr(dma_chan_t *chan)
+{
+    DMA_TypeDef *dma = (DMA_TypeDef *)((uint32_t)chan & ~0xff);
+    if ((uint32_t)chan - (uint32_t)dma >= 0x10 + 4 * 0x18)
+        return &dma->HIFCR;
+    return &dma->LIFCR;
+}
+#endif
+
+// Read and clear the half and full transfer flags of a dma channel
+static uint32_t
+dma_chan_take_flags(dma_chan_t *chan)
+{
+#if HAVE_DMA_STREAMS
+    volatile uint32_t *ifcr = dma_stream_ifcr(chan);
+    // The LISR/HISR registers directly precede LIFCR/HIFCR
+    uint32_t shift = dma_stream_flag_shift(chan);
+    uint32_t isr = ifcr[-2] >> shift;
+    *ifcr = (DMA_LIFCR_CHTIF0 | DMA_LIFCR_CTCIF0) << shift;
+    return (((isr & DMA_LISR_HTIF0) ? DMA_FLAG_HT : 0)
+            | ((isr & DMA_LISR_TCIF0) ? DMA_FLAG_TC : 0));
+#else
+    DMA_TypeDef *dma = (DMA_TypeDef *)((uint32_t)chan & ~0xff);
+    uint32_t shift = 4 * (((uint32_t)chan - (uint32_t)dma - 0x08) / 0x14);
+    uint32_t isr = dma->ISR >> shift;
+    dma->IFCR = (DMA_IFCR_CHTIF1 | DMA_IFCR_CTCIF1) << shift;
+    return (((isr & DMA_ISR_HTIF1) ? DMA_FLAG_HT : 0)
+            | ((isr & DMA_ISR_TCIF1) ? DMA_FLAG_TC : 0));
+#endif
+}
+
+// Disable a dma channel
+static void
+dma_chan_stop(dma_chan_t *chan)
+{
+#if HAVE_DMA_STREAMS
+    chan->CR = 0;
+    while (chan->CR & DMA_SxCR_EN)
+        ;
+#else
+    chan->CCR = 0;
+#endif
+}
+
+// Start a transfer on a dma channel
+static void
+dma_chan_start(dma_chan_t *chan, uint32_t cfg, volatile void *periph
+               , void *mem, uint32_t count)
+{
+    dma_chan_stop(chan);
+#if HAVE_DMA_STREAMS
+    // Stream event flags must be cleared before the stream is enabled
+    *dma_stream_ifcr(chan) = 0x3d << dma_stream_flag_shift(chan);
+    chan->PAR = (uint32_t)periph;
+    chan->M0AR = (uint32_t)mem;
+    chan->NDTR = count;
+    chan->FCR = 0;
+    chan->CR = cfg | DMA_SxCR_EN;
+#else
+    chan->CPAR = (uint32_t)periph;
+    chan->CMAR = (uint32_t)mem;
+    chan->CNDTR = count;
+    chan->CCR = cfg | DMA_CCR_EN;
+#endif
+}
+
+// Return the number of items a dma channel has yet to transfer
+static uint32_t
+dma_chan_remaining(dma_chan_t *chan)
+{
+#if HAVE_DMA_STREAMS
+    return chan->NDTR;
+#else
+    return chan->CNDTR;
+#endif
+}
+
+
+/****************************************************************
+ * Serial interface
+ ****************************************************************/
+
+// Check if a buffer position lies in the data after rx_pos up to end
+static int
+rx_passed(uint32_t pos, uint8_t end)
+{
+    uint8_t dist = pos - rx_pos;
+    return dist && dist <= (uint8_t)(end - rx_pos);
+}
+
+// Pass any bytes received by the dma controller to the serial code.
+// Returns -1 (and stops reception) if unprocessed data was overwritten.
+int
+serial_dma_rx_poll(void)
+{
+    uint8_t head = RX_BUF_SIZE - dma_chan_remaining(rx_chan);
+    uint32_t flags = dma_chan_take_flags(rx_chan);
+    uint8_t end = RX_BUF_SIZE - dma_chan_remaining(rx_chan);
+    // Every half/full transfer flag must come from a position that was
+    // reached after rx_pos, otherwise the controller lapped the buffer.
+    // A lap is missed only if the unprocessed data spans both positions.
+    if ((flags & DMA_FLAG_HT && !rx_passed(RX_BUF_SIZE / 2, end))
+        || (flags & DMA_FLAG_TC && !rx_passed(RX_BUF_SIZE, end))) {
+        dma_chan_stop(rx_chan);
+        return -1;
+    }
+#if __CORTEX_M == 7
+    SCB_InvalidateDCache_by_Addr((void*)rx_buf, sizeof(rx_buf));
+#endif
+    while (rx_pos != head)
+        serial_rx_byte(rx_buf[rx_pos++]);
+    return 0;
+}
+
+// Return the number of bytes the active transmit has yet to send
+uint32_t
+serial_dma_tx_pending(void)
+{
+    return dma_chan_remaining(tx_chan);
+}
+
+// Move pending transmit data into the dma buffer
+uint32_t
+serial_dma_tx_fill(void)
+{
+    uint32_t count = 0;
+    while (count < sizeof(tx_buf) && !serial_get_tx_byte(&tx_buf[count]))
+        count++;
+    return count;
+}
+
+// Start transmitting a buffer filled by serial_dma_tx_fill()
+void
+serial_dma_tx_start(uint32_t count)
+{
+#if __CORTEX_M == 7
+    SCB_CleanDCache_by_Addr((void*)tx_buf, sizeof(tx_buf));
+#endif
+    dma_chan_start(tx_chan, tx_cfg, tx_reg, tx_buf, count);
+}
+
+// Setup circular reception and buffered transmission for a usart
+void
+serial_dma_setup(uint32_t usart_base, volatile void *rx_reg
+                 , volatile void *usart_tx_reg)
+{
+    enable_dma_clock();
+    struct dma_route route = lookup_dma_route(usart_base);
+    rx_chan = route.rx;
+    tx_chan = route.tx;
+    tx_reg = usart_tx_reg;
+#if CONFIG_MACH_STM32F2 || CONFIG_MACH_STM32F4
+    uint32_t rx_cfg = ((route.rx_req << DMA_SxCR_CHSEL_Pos)
+                       | DMA_SxCR_MINC | DMA_SxCR_CIRC);
+    tx_cfg = ((route.tx_req << DMA_SxCR_CHSEL_Pos)
+              | DMA_SxCR_MINC | DMA_SxCR_DIR_0);
+#elif HAVE_DMA_STREAMS
+    DMAMUX1_Channel0->CCR = route.rx_req;
+    DMAMUX1_Channel1->CCR = route.tx_req;
+    uint32_t rx_cfg = DMA_SxCR_MINC | DMA_SxCR_CIRC;
+    tx_cfg = DMA_SxCR_MINC | DMA_SxCR_DIR_0;
+#else
+  #if CONFIG_MACH_STM32G0 || CONFIG_MACH_STM32G4
+    DMAMUX1_Channel0->CCR = route.rx_req;
+    DMAMUX1_Channel1->CCR = route.tx_req;
+  #endif
+    uint32_t rx_cfg = DMA_CCR_MINC | DMA_CCR_CIRC;
+    tx_cfg = DMA_CCR_MINC | DMA_CCR_DIR;
+#endif
+    dma_chan_start(rx_chan, rx_cfg, rx_reg, rx_buf, sizeof(rx_buf));
+}
@@ -6,6 +6,7 @@
 
 #include "autoconf.h" // CONFIG_SERIAL_BAUD
 #include "board/armcm_boot.h" // armcm_enable_irq
+#include "board/irq.h" // irq_save
 #include "board/serial_irq.h" // serial_rx_byte
 #include "command.h" // DECL_CONSTANT_STR
 #include "internal.h" // enable_pclock
@@ -124,13 +125,36 @@
   #define USART_ISR_TXE USART_ISR_TXE_TXFNF
 #endif
 
+// Reception falls back to per byte interrupts if the dma buffer overflows
+static uint8_t dma_rx_active = 1;
+#define DMA_RX_ACTIVE (CONFIG_STM32_SERIAL_DMA && dma_rx_active)
+
 #define CR1_FLAGS (USART_CR1_UE | USART_CR1_RE | USART_CR1_TE   \
-                   | USART_CR1_RXNEIE)
+                   | (DMA_RX_ACTIVE ? USART_CR1_IDLEIE               \
+                      : USART_CR1_RXNEIE))
+
+// Pass received dma data to the serial code
+static void
+usart_dma_rx_poll(void)
+{
+    if (!DMA_RX_ACTIVE || !serial_dma_rx_poll())
+        return;
+    dma_rx_active = 0;
+    USARTx->CR3 &= ~USART_CR3_DMAR;
+    USARTx->CR1 = CR1_FLAGS;
+}
 
 void
 USARTx_IRQHandler(void)
 {
     uint32_t sr = USARTx->ISR;
+    if (DMA_RX_ACTIVE) {
+        if (sr & USART_ISR_IDLE) {
+            USARTx->ICR = USART_ICR_IDLECF;
+            usart_dma_rx_poll();
+        }
+        return;
+    }
     if (sr & USART_ISR_RXNE)
         serial_rx_byte(USARTx->RDR);
     if (sr & USART_ISR_TXE && USARTx->CR1 & USART_CR1_TXEIE) {
@@ -143,22 +167,93 @@ USARTx_IRQHandler(void)
     }
 }
 
+// Start a dma transmit once the previous one has fully completed
+static void
+usart_dma_tx_check(void)
+{
+    if (serial_dma_tx_pending() || !(USARTx->ISR & USART_ISR_TC))
+        return;
+    uint32_t count = serial_dma_tx_fill();
+    if (!count)
+        return;
+    USARTx->ICR = USART_ICR_TCCF;
+    serial_dma_tx_start(count);
+}
+
 void
 serial_enable_tx_irq(void)
 {
-    USARTx->CR1 = CR1_FLAGS | USART_CR1_TXEIE;
+    if (CONFIG_STM32_SERIAL_DMA)
+        usart_dma_tx_check();
+    else
+        USARTx->CR1 = CR1_FLAGS | USART_CR1_TXEIE;
 }
 
+#if CONFIG_STM32_SERIAL_DMA
+// Process dma buffers that were not handled from the idle irq
 void
-serial_init(void)
+usart_dma_task(void)
 {
-    enable_pclock((uint32_t)USARTx);
+    irqstatus_t flag = irq_save();
+    usart_dma_rx_poll();
+    irq_restore(flag);
+    usart_dma_tx_check();
+}
+DECL_TASK(usart_dma_task);
+#endif
 
+static void
+usart_set_brr(uint32_t baud)
+{
     uint32_t pclk = get_pclock_frequency((uint32_t)USARTx);
-    uint32_t div = DIV_ROUND_CLOSEST(pclk, CONFIG_SERIAL_BAUD);
+    uint32_t div = DIV_ROUND_CLOSEST(pclk, baud);
     USARTx->BRR = (((div / 16) << USART_BRR_DIV_MANTISSA_Pos)
                    | ((div % 16) << USART_BRR_DIV_FRACTION_Pos));
+}
+
+// Return the baud rate generated for a requested rate (or 0 if invalid)
+uint32_t
+serial_calc_baud(uint32_t baud)
+{
+    uint32_t pclk = get_pclock_frequency((uint32_t)USARTx);
+    uint32_t div = DIV_ROUND_CLOSEST(pclk, baud);
+    if (div < 16 || div > 0xffff)
+        return 0;
+    return pclk / div;
+}
+
+// Check if the last byte handed to the uart has been transmitted
+int
+serial_tx_done(void)
+{
+    if (CONFIG_STM32_SERIAL_DMA && serial_dma_tx_pending())
+        return 0;
+    return !!(USARTx->ISR & USART_ISR_TC);
+}
+
+// Change the baud rate after the last byte has been transmitted
+void
+serial_set_baud(uint32_t baud)
+{
+    while (!(USARTx->ISR & USART_ISR_TC))
+        ;
+    // The BRR register may only be written while the usart is disabled
+    USARTx->CR1 = 0;
+    usart_set_brr(baud);
+    USARTx->CR1 = CR1_FLAGS;
+}
+
+void
+serial_init(void)
+{
+    enable_pclock((uint32_t)USARTx);
+
+    usart_set_brr(CONFIG_SERIAL_BAUD);
     USARTx->CR3 = USART_CR3_OVRDIS; // disable the ORE ISR
+    if (CONFIG_STM32_SERIAL_DMA) {
+        serial_dma_setup((uint32_t)USARTx, &USARTx->RDR, &USARTx->TDR);
+        USARTx->CR3 |= USART_CR3_DMAR | USART_CR3_DMAT;
+    }
     USARTx->CR1 = CR1_FLAGS;
     armcm_enable_irq(USARTx_IRQHandler, USARTx_IRQn, 0);
 
@@ -9,6 +9,7 @@
 #include "board/armcm_timer.h" // udelay
 #include "board/gpio.h" // gpio_out_setup
 #include "board/io.h" // writeb
+#include "board/irq.h" // irq_save
 #include "board/usb_cdc.h" // usb_notify_ep0
 #include "board/usb_cdc_ep.h" // USB_CDC_EP_BULK_IN
 #include "command.h" // DECL_CONSTANT_STR
@@ -261,14 +262,12 @@ usb_send_bulk_in(void *data, uint_fast8_t len)
     if (epr_is_dbuf_blocking(epr) && readl(&bulk_in_pop_flag)) {
         writel(&bulk_in_pop_flag, 0);
         if (unlikely(bipp & BI_START)) {
-            // Two packets are always sent when starting in double
-            // buffering mode, so wait for second packet before starting.
-            if (bipp == (BI_START | 1)) {
-                bulk_in_push_pos = 0;
-                writel(&bulk_in_pop_flag, USB_EP_KIND); // Dummy flag
-                USB_EPR[ep] = calc_epr_bits(epr, USB_EPTX_STAT
-                                            , USB_EP_TX_VALID);
-            }
+            // Two packets are sent when starting in double buffering
+            // mode unless the second buffer is handed to software.
+            // Toggle SW_BUF with the start, so only this packet is sent.
+            bulk_in_push_pos = 1;
+            USB_EPR[ep] = (calc_epr_bits(epr, USB_EPTX_STAT, USB_EP_TX_VALID)
+                           | USB_EP_DTOG_RX);
         } else {
             USB_EPR[ep] = calc_epr_bits(epr, 0, 0) | USB_EP_DTOG_RX;
         }
@@ -340,6 +339,29 @@ usb_set_configure(void)
     writel(&bulk_in_pop_flag, 0);
 }
 
+// Restart a bulk endpoint at DATA0 (after a CLEAR_FEATURE request)
+void
+usb_reset_bulk_toggle(uint_fast8_t is_in)
+{
+    irqstatus_t flag = irq_save();
+    uint32_t togglebits = USB_EP_DTOG_RX | USB_EP_DTOG_TX;
+    if (is_in) {
+        uint32_t ep = USB_CDC_EP_BULK_IN;
+        USB_EPR[ep] = calc_epr_bits(USB_EPR[ep], togglebits | USB_EPTX_STAT
+                                    , USB_EP_TX_NAK);
+        bulk_in_push_pos = BI_START;
+        bulk_in_pop_flag = 0;
+    } else {
+        // Same buffer state as after usb_reset() and usb_set_configure()
+        uint32_t ep = USB_CDC_EP_BULK_OUT;
+        USB_EPR[ep] = calc_epr_bits(USB_EPR[ep], togglebits | USB_EPRX_STAT
+                                    , USB_EP_DTOG_TX | USB_EP_RX_VALID);
+        bulk_out_pop_count = 0;
+        bulk_out_push_flag = USB_EP_DTOG_TX;
+    }
+    irq_restore(flag);
+}
+
 
 /****************************************************************
  * Setup and interrupts
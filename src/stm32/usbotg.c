@@ -67,6 +67,10 @@ usb_irq_enable(void)
 #define EPOUT(EP) ((USB_OTG_OUTEndpointTypeDef*)                        \
                    (USB_PERIPH_BASE + USB_OTG_OUT_ENDPOINT_BASE + ((EP) << 5)))
 
+// Number of packets the bulk out endpoint may receive before rearming
+// (the rx fifo already has room for four bulk out packets)
+#define BULK_OUT_PKTCNT 2
+
 // Setup the USB fifos
 static void
 fifo_configure(void)
@@ -144,6 +148,17 @@ fifo_read_packet(uint8_t *dest, uint_fast8_t max_len)
     return xfer;
 }
 
+// Return the transfer size to arm on an rx endpoint
+static uint32_t
+rx_endpoint_tsiz(uint32_t ep)
+{
+    if (ep == USB_CDC_EP_BULK_OUT)
+        // Permit the host to send multiple packets without waiting
+        return (BULK_OUT_PKTCNT * USB_CDC_EP_BULK_OUT_SIZE
+                | (BULK_OUT_PKTCNT << USB_OTG_DOEPTSIZ_PKTCNT_Pos));
+    return 64 | (1 << USB_OTG_DOEPTSIZ_PKTCNT_Pos);
+}
+
 // Reenable packet reception if it got disabled by controller
 static void
 enable_rx_endpoint(uint32_t ep)
@@ -151,7 +166,7 @@ enable_rx_endpoint(uint32_t ep)
     USB_OTG_OUTEndpointTypeDef *epo = EPOUT(ep);
     uint32_t ctl = epo->DOEPCTL;
     if (!(ctl & USB_OTG_DOEPCTL_EPENA) || ctl & USB_OTG_DOEPCTL_NAKSTS) {
-        epo->DOEPTSIZ = 64 | (1 << USB_OTG_DOEPTSIZ_PKTCNT_Pos);
+        epo->DOEPTSIZ = rx_endpoint_tsiz(ep);
         epo->DOEPCTL = ctl | USB_OTG_DOEPCTL_EPENA | USB_OTG_DOEPCTL_CNAK;
     }
 }
@@ -352,7 +367,7 @@ usb_set_configure(void)
 
     // Configure and enable USB_CDC_EP_BULK_OUT
     USB_OTG_OUTEndpointTypeDef *epo = EPOUT(USB_CDC_EP_BULK_OUT);
-    epo->DOEPTSIZ = 64 | (1 << USB_OTG_DOEPTSIZ_PKTCNT_Pos);
+    epo->DOEPTSIZ = rx_endpoint_tsiz(USB_CDC_EP_BULK_OUT);
     epo->DOEPCTL = (
         USB_OTG_DOEPCTL_CNAK | USB_OTG_DOEPCTL_USBAEP | USB_OTG_DOEPCTL_EPENA
         | (0x02 << USB_OTG_DOEPCTL_EPTYP_Pos) | USB_OTG_DOEPCTL_SD0PID_SEVNFRM
@@ -376,6 +391,18 @@ usb_set_configure(void)
     usb_irq_enable();
 }
 
+// Restart a bulk endpoint at DATA0 (after a CLEAR_FEATURE request)
+void
+usb_reset_bulk_toggle(uint_fast8_t is_in)
+{
+    usb_irq_disable();
+    if (is_in)
+        EPIN(USB_CDC_EP_BULK_IN)->DIEPCTL |= USB_OTG_DIEPCTL_SD0PID_SEVNFRM;
+    else
+        EPOUT(USB_CDC_EP_BULK_OUT)->DOEPCTL |= USB_OTG_DOEPCTL_SD0PID_SEVNFRM;
+    usb_irq_enable();
+}
+
 
 /****************************************************************
  * Setup and interrupts